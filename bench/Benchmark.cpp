@@ -0,0 +1,423 @@
+#include "../src/BrushCache.hpp"
+#include "../src/Erosion.hpp"
+#include "../src/ErosionBrush.hpp"
+#include "../src/MapGenerator.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct BenchConfig {
+    std::vector<int> sizes = {256, 512, 1024, 2048, 4096, 8192};
+    std::vector<int> radii = {1, 2, 3, 4, 5, 6, 7, 8};
+    int droplets = 200000;
+    // Square region eroded around the map center by erodeRegion, like one stroke in an editor
+    int regionSize = 256;
+    int regionDroplets = 20000;
+    int repeat = 3;
+    int threads = 1;
+    int samples = 1 << 22;
+    ErosionKernel kernel = ErosionKernel::Scalar;
+    std::string output;
+};
+
+// Best and median wall time of a repeated measurement
+struct Timing {
+    double best;
+    double median;
+};
+
+template<class Setup, class Run>
+Timing measure(int repeat, Setup setup, Run run) {
+    std::vector<double> seconds;
+    for (int i = 0; i < repeat; i++) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(seconds.begin(), seconds.end());
+    return {seconds.front(), seconds[seconds.size() / 2]};
+}
+
+// One flat JSON object per result, values are written in insertion order
+class JsonRecord {
+public:
+    JsonRecord& add(const std::string& key, const std::string& value) {
+        fields.push_back("\"" + key + "\": \"" + value + "\"");
+        return *this;
+    }
+
+    JsonRecord& add(const std::string& key, double value) {
+        std::ostringstream out;
+        out.precision(10);
+        out << value;
+        fields.push_back("\"" + key + "\": " + out.str());
+        return *this;
+    }
+
+    JsonRecord& add(const std::string& key, Timing timing) {
+        add(key + "Best", timing.best);
+        return add(key + "Median", timing.median);
+    }
+
+    std::string str() const {
+        std::string out = "{";
+        for (size_t i = 0; i < fields.size(); i++) {
+            out += (i ? ", " : "") + fields[i];
+        }
+        return out + "}";
+    }
+
+private:
+    std::vector<std::string> fields;
+};
+
+// Hardware cache misses of the calling thread in user space. Reads -1 where perf events aren't available,
+// as in most containers and virtual machines
+class CacheMissCounter {
+public:
+    // config is PERF_COUNT_HW_CACHE_MISSES or a PERF_TYPE_HW_CACHE event of type
+    CacheMissCounter(unsigned type, unsigned long long config) {
+#if defined(__linux__)
+        perf_event_attr attributes = {};
+        attributes.size = sizeof(attributes);
+        attributes.type = type;
+        attributes.config = config;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        handle = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+    }
+
+    ~CacheMissCounter() {
+#if defined(__linux__)
+        if (handle >= 0) {
+            close(handle);
+        }
+#endif
+    }
+
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+    void start() {
+#if defined(__linux__)
+        if (handle >= 0) {
+            ioctl(handle, PERF_EVENT_IOC_RESET, 0);
+            ioctl(handle, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop() {
+        long long count = -1;
+#if defined(__linux__)
+        if (handle >= 0) {
+            ioctl(handle, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(handle, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int handle = -1;
+};
+
+std::vector<int> parseList(const std::string& text) {
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(atoi(item.c_str()));
+    }
+    return values;
+}
+
+void benchGenerateMap(const BenchConfig& config, std::vector<JsonRecord>& results,
+                      std::map<int, std::vector<float>>& maps) {
+    for (int size : config.sizes) {
+        std::cerr << "generateMap " << size << std::endl;
+        Timing timing = measure(config.repeat, [] {}, [&] { maps[size] = generateMap(size, config.threads); });
+        results.push_back(JsonRecord()
+            .add("benchmark", "generateMap")
+            .add("mapSize", size)
+            .add("threads", config.threads)
+            .add("seconds", timing)
+            .add("pixelsPerSecond", (double)size * size / timing.best));
+    }
+}
+
+void benchBrush(const BenchConfig& config, std::vector<JsonRecord>& results) {
+    for (int size : config.sizes) {
+        for (int radius : config.radii) {
+            std::cerr << "brush " << size << " r" << radius << std::endl;
+            size_t bytes = 0;
+            Timing timing = measure(config.repeat, [] {}, [&] {
+                ErosionBrush brush(size, radius);
+                bytes = brush.memoryUsage();
+            });
+            // What every eroder after the first pays for the same brush
+            HeightmapView shape = {nullptr, size, size, size};
+            BrushCache::shared().get(shape, radius, HeightmapLayout::RowMajor);
+            Timing cachedTiming = measure(config.repeat, [] {}, [&] {
+                BrushCache::shared().get(shape, radius, HeightmapLayout::RowMajor);
+            });
+            // Only the timing needed it, larger maps shouldn't pile their brushes up on top
+            BrushCache::shared().evictUnused();
+            results.push_back(JsonRecord()
+                .add("benchmark", "brush")
+                .add("mapSize", size)
+                .add("erosionRadius", radius)
+                .add("seconds", timing)
+                .add("cachedSeconds", cachedTiming)
+                .add("bytes", (double)bytes));
+        }
+    }
+}
+
+void benchHeightAndGradient(const BenchConfig& config, std::vector<JsonRecord>& results) {
+    const int size = 1024;
+    std::cerr << "calculateHeightAndGradient" << std::endl;
+    std::vector<float> map = generateMap(size);
+
+    std::mt19937 engine(1234);
+    std::uniform_real_distribution<float> position(0, size - 1);
+    std::vector<float> posX(config.samples);
+    std::vector<float> posY(config.samples);
+    for (int i = 0; i < config.samples; i++) {
+        posX[i] = position(engine);
+        posY[i] = position(engine);
+    }
+
+    Erosion eroder;
+    volatile float sink = 0;
+    Timing timing = measure(config.repeat, [] {}, [&] {
+        float sum = 0;
+        for (int i = 0; i < config.samples; i++) {
+            HeightAndGradient sample = eroder.calculateHeightAndGradient(map.data(), size, posX[i], posY[i]);
+            sum += sample.height + sample.gradientX + sample.gradientY;
+        }
+        sink = sink + sum;
+    });
+    results.push_back(JsonRecord()
+        .add("benchmark", "calculateHeightAndGradient")
+        .add("mapSize", size)
+        .add("calls", config.samples)
+        .add("seconds", timing)
+        .add("nanosecondsPerCall", timing.best * 1e9 / config.samples));
+}
+
+void benchErode(const BenchConfig& config, std::vector<JsonRecord>& results, std::map<int, std::vector<float>>& maps) {
+    for (int size : config.sizes) {
+        for (int radius : config.radii) {
+            std::cerr << "erode " << size << " r" << radius << std::endl;
+            Erosion eroder;
+            eroder.seed = 1231204;
+            eroder.erosionRadius = radius;
+            eroder.numThreads = config.threads;
+            eroder.schedule = config.threads > 1 ? DropletSchedule::Tiled : DropletSchedule::Sequential;
+            eroder.kernel = config.kernel;
+
+            // Builds the brush outside the measurement
+            std::vector<float> map = maps[size];
+            eroder.erode(&map, size, 0, true);
+
+            long long steps = 0;
+            Timing timing = measure(config.repeat, [&] { map = maps[size]; }, [&] {
+                eroder.erode(&map, size, config.droplets, true);
+                steps = eroder.simulatedSteps;
+            });
+            results.push_back(JsonRecord()
+                .add("benchmark", "erode")
+                .add("mapSize", size)
+                .add("erosionRadius", radius)
+                .add("kernel", erosionKernelName(eroder.resolveKernel()))
+                .add("threads", config.threads)
+                .add("droplets", config.droplets)
+                .add("steps", (double)steps)
+                .add("seconds", timing)
+                .add("dropletsPerSecond", config.droplets / timing.best)
+                .add("stepsPerSecond", steps / timing.best));
+        }
+    }
+}
+
+// Same droplets in spawn order and binned by spawn position. On maps much bigger than the caches the
+// binned schedule should take fewer cache misses per droplet step
+void benchSchedules(const BenchConfig& config, std::vector<JsonRecord>& results,
+                    std::map<int, std::vector<float>>& maps) {
+#if defined(__linux__)
+    CacheMissCounter lastLevelMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    CacheMissCounter l1Misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+    CacheMissCounter lastLevelMisses(0, 0);
+    CacheMissCounter l1Misses(0, 0);
+#endif
+    const std::pair<DropletSchedule, const char*> schedules[] = {
+        {DropletSchedule::Sequential, "sequential"}, {DropletSchedule::Binned, "binned"}};
+    for (int size : config.sizes) {
+        for (auto [schedule, name] : schedules) {
+            std::cerr << "schedule " << name << " " << size << std::endl;
+            Erosion eroder;
+            eroder.seed = 1231204;
+            eroder.schedule = schedule;
+            eroder.kernel = config.kernel;
+
+            // Builds the brush outside the measurement
+            std::vector<float> map = maps[size];
+            eroder.erode(&map, size, 0, true);
+
+            long long steps = 0;
+            long long misses = -1;
+            long long l1DataMisses = -1;
+            Timing timing = measure(config.repeat, [&] { map = maps[size]; }, [&] {
+                lastLevelMisses.start();
+                l1Misses.start();
+                eroder.erode(&map, size, config.droplets, true);
+                long long runL1DataMisses = l1Misses.stop();
+                long long runMisses = lastLevelMisses.stop();
+                // The fewest misses of any repeat, like the best time
+                misses = misses < 0 ? runMisses : std::min(misses, runMisses);
+                l1DataMisses = l1DataMisses < 0 ? runL1DataMisses : std::min(l1DataMisses, runL1DataMisses);
+                steps = eroder.simulatedSteps;
+            });
+            results.push_back(JsonRecord()
+                .add("benchmark", "schedule")
+                .add("mapSize", size)
+                .add("schedule", name)
+                .add("kernel", erosionKernelName(eroder.resolveKernel()))
+                .add("droplets", config.droplets)
+                .add("steps", (double)steps)
+                .add("seconds", timing)
+                .add("stepsPerSecond", steps / timing.best)
+                .add("cacheMisses", (double)misses)
+                .add("l1DataMisses", (double)l1DataMisses)
+                .add("cacheMissesPerStep", misses < 0 ? -1.0 : (double)misses / std::max(1LL, steps)));
+        }
+    }
+}
+
+void benchErodeRegion(const BenchConfig& config, std::vector<JsonRecord>& results,
+                      std::map<int, std::vector<float>>& maps) {
+    for (int size : config.sizes) {
+        int regionSize = std::min(config.regionSize, size - 1);
+        MapRect region = {(size - regionSize) / 2, (size - regionSize) / 2, regionSize, regionSize};
+        std::cerr << "erodeRegion " << size << " " << regionSize << std::endl;
+        Erosion eroder;
+        eroder.seed = 1231204;
+        eroder.numThreads = config.threads;
+        eroder.schedule = config.threads > 1 ? DropletSchedule::Tiled : DropletSchedule::Sequential;
+        eroder.kernel = config.kernel;
+
+        // Builds the brush outside the measurement, later strokes on the same map reuse it
+        std::vector<float> map = maps[size];
+        HeightmapView view = {map.data(), size, size, size};
+        eroder.erodeRegion(view, region, 0, true);
+
+        MapRect changed = {};
+        Timing timing = measure(config.repeat, [&] { map = maps[size]; }, [&] {
+            eroder.erodeRegion(view, region, config.regionDroplets, true, &changed);
+        });
+        results.push_back(JsonRecord()
+            .add("benchmark", "erodeRegion")
+            .add("mapSize", size)
+            .add("regionSize", regionSize)
+            .add("kernel", erosionKernelName(eroder.resolveKernel()))
+            .add("threads", config.threads)
+            .add("droplets", config.regionDroplets)
+            .add("changedCells", (double)changed.width * changed.height)
+            .add("seconds", timing));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* usage = "Usage is ./Hydraulic-Erosion-bench [--quick] [--sizes <a,b,..>] [--radii <a,b,..>] "
+                        "[--droplets <count>] [--repeat <count>] [--threads <count>] [--kernel <name>] [--output <file>]";
+
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--quick") {
+            config.sizes = {256, 1024};
+            config.radii = {1, 3, 8};
+            config.droplets = 50000;
+            config.repeat = 2;
+            config.samples = 1 << 20;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[++i];
+
+        if (option == "--sizes") {
+            config.sizes = parseList(value);
+        } else if (option == "--radii") {
+            config.radii = parseList(value);
+        } else if (option == "--droplets") {
+            config.droplets = atoi(value.c_str());
+        } else if (option == "--repeat") {
+            config.repeat = std::max(1, atoi(value.c_str()));
+        } else if (option == "--threads") {
+            config.threads = std::max(1, atoi(value.c_str()));
+        } else if (option == "--kernel") {
+            if (!parseErosionKernel(value, config.kernel)) {
+                std::cout << "Unknown kernel " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--output") {
+            config.output = value;
+        } else {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<JsonRecord> results;
+    std::map<int, std::vector<float>> maps;
+    benchGenerateMap(config, results, maps);
+    benchBrush(config, results);
+    benchHeightAndGradient(config, results);
+    benchErode(config, results, maps);
+    benchSchedules(config, results, maps);
+    benchErodeRegion(config, results, maps);
+
+    std::ostringstream json;
+    json << "{\n  \"machine\": " << JsonRecord().add("hardwareThreads", std::thread::hardware_concurrency()).str()
+         << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        json << "    " << results[i].str() << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}\n";
+
+    if (config.output.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream file(config.output);
+        file << json.str();
+        if (!file) {
+            std::cerr << "Could not write " << config.output << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
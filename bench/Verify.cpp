@@ -0,0 +1,911 @@
+#include "../src/Batch.hpp"
+#include "../src/BrushCache.hpp"
+#include "../src/Checkpoint.hpp"
+#include "../src/Erosion.hpp"
+#include "../src/ErosionPyramid.hpp"
+#include "../src/MapGenerator.hpp"
+#include "../src/MapInput.hpp"
+#include "../src/Philox.hpp"
+#include "../src/PipeErosion.hpp"
+#include "../src/ShardedErosion.hpp"
+#include "../src/SnapshotRing.hpp"
+#include "../src/TiffWriter.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Differential check of every optimized droplet path against a plain reference of the scalar algorithm.
+// Paths that keep the droplet order (scalar kernels, strides, the blocked layout) have to match it bit for bit.
+// Paths that reorder droplets (packet kernels, the tiled and binned schedules) only have to stay close to it,
+// conserve mass and give the same map for every thread count and split of the run. The other stages of a run
+// (sharding, snapshots, pyramid, checkpoints, map input, image output and batches) are checked once on a fixed map
+
+struct VerifyConfig {
+    int cases = 24;
+    unsigned seed = 1;
+    int minSize = 16;
+    int maxSize = 320;
+    // Droplets per map cell
+    float density = 0.75f;
+    // A path that reorders droplets ends up about as far from the reference as a run with another seed. Its RMS
+    // difference from the reference may be at most this many times that of another seed
+    double tolerance = 1.5;
+    // and the sediment it erodes and deposits in total at most this fraction off the reference
+    double sedimentTolerance = 0.25;
+};
+
+// What the reference run did
+struct ReferenceResult {
+    std::vector<float> map;
+    double eroded = 0;
+    double deposited = 0;
+};
+
+// The droplet algorithm written as plainly as possible: brush weights worked out for every step
+// and no tables, stencils, packets or tiles
+class ReferenceErosion {
+public:
+    explicit ReferenceErosion(const Erosion &parameters) : parameters(parameters) {}
+
+    HeightAndGradient sample(const std::vector<float> &map, int width, float posX, float posY) const {
+        int coordX = (int)posX;
+        int coordY = (int)posY;
+        float x = posX - coordX;
+        float y = posY - coordY;
+        float heightNW = map[coordY * width + coordX];
+        float heightNE = map[coordY * width + coordX + 1];
+        float heightSW = map[(coordY + 1) * width + coordX];
+        float heightSE = map[(coordY + 1) * width + coordX + 1];
+        float gradientX = (heightNE - heightNW) * (1 - y) + (heightSE - heightSW) * y;
+        float gradientY = (heightSW - heightNW) * (1 - x) + (heightSE - heightNE) * x;
+        float height =
+            heightNW * (1 - x) * (1 - y) + heightNE * x * (1 - y) + heightSW * (1 - x) * y + heightSE * x * y;
+        return {height, gradientX, gradientY};
+    }
+
+    ReferenceResult erode(std::vector<float> map, int width, int height, int numIterations) const {
+        const Erosion &p = parameters;
+        ReferenceResult result;
+        for (int droplet = 0; droplet < numIterations; droplet++) {
+            std::array<uint32_t, 4> bits = Philox4x32::generate(droplet, (uint32_t)p.seed);
+            float maxX = (float)(width - 1);
+            float maxY = (float)(height - 1);
+            float posX = std::min(Philox4x32::toUnitFloat(bits[0]) * maxX, std::nextafter(maxX, 0.0f));
+            float posY = std::min(Philox4x32::toUnitFloat(bits[1]) * maxY, std::nextafter(maxY, 0.0f));
+            float dirX = 0;
+            float dirY = 0;
+            float speed = p.initialSpeed;
+            float water = p.initialWaterVolume;
+            float sediment = 0;
+
+            for (int lifetime = 0; lifetime < p.maxDropletLifetime; lifetime++) {
+                int nodeX = (int)posX;
+                int nodeY = (int)posY;
+                float cellOffsetX = posX - nodeX;
+                float cellOffsetY = posY - nodeY;
+
+                HeightAndGradient start = sample(map, width, posX, posY);
+                dirX = (dirX * p.inertia - start.gradientX * (1 - p.inertia));
+                dirY = (dirY * p.inertia - start.gradientY * (1 - p.inertia));
+                float len = std::sqrt(dirX * dirX + dirY * dirY);
+                if (len != 0) {
+                    dirX /= len;
+                    dirY /= len;
+                }
+                posX += dirX;
+                posY += dirY;
+                if ((dirX == 0 && dirY == 0) || posX < 0 || posX >= width - 1 || posY < 0 || posY >= height - 1) {
+                    break;
+                }
+
+                float deltaHeight = sample(map, width, posX, posY).height - start.height;
+                float sedimentCapacity = std::max(-deltaHeight * speed * water * p.sedimentCapacityFactor,
+                                                  p.minSedimentCapacity);
+                if (sediment > sedimentCapacity || deltaHeight > 0) {
+                    float amountToDeposit = (deltaHeight > 0) ? std::min(deltaHeight, sediment)
+                                                              : (sediment - sedimentCapacity) * p.depositSpeed;
+                    sediment -= amountToDeposit;
+                    result.deposited += amountToDeposit;
+                    int cell = nodeY * width + nodeX;
+                    map[cell] += amountToDeposit * (1 - cellOffsetX) * (1 - cellOffsetY);
+                    map[cell + 1] += amountToDeposit * cellOffsetX * (1 - cellOffsetY);
+                    map[cell + width] += amountToDeposit * (1 - cellOffsetX) * cellOffsetY;
+                    map[cell + width + 1] += amountToDeposit * cellOffsetX * cellOffsetY;
+                } else {
+                    float amountToErode = std::min((sedimentCapacity - sediment) * p.erodeSpeed, -deltaHeight);
+                    // Brush points inside the map, their weights renormalized to sum to one
+                    int radius = p.erosionRadius;
+                    float clippedSum = 0;
+                    for (int pass = 0; pass < 2; pass++) {
+                        for (int y = -radius; y <= radius; y++) {
+                            for (int x = -radius; x <= radius; x++) {
+                                float sqrDst = x * x + y * y;
+                                int cellX = nodeX + x;
+                                int cellY = nodeY + y;
+                                if (sqrDst >= radius * radius || cellX < 0 || cellX >= width || cellY < 0 ||
+                                    cellY >= height) {
+                                    continue;
+                                }
+                                float weight = 1 - std::sqrt(sqrDst) / radius;
+                                if (pass == 0) {
+                                    clippedSum += weight;
+                                    continue;
+                                }
+                                float &cell = map[cellY * width + cellX];
+                                float weighedErodeAmount = amountToErode * (weight / clippedSum);
+                                float deltaSediment = (cell < weighedErodeAmount) ? cell : weighedErodeAmount;
+                                cell -= deltaSediment;
+                                sediment += deltaSediment;
+                                result.eroded += deltaSediment;
+                            }
+                        }
+                    }
+                }
+
+                speed = std::sqrt(speed * speed + std::abs(deltaHeight) * p.gravity);
+                water *= (1 - p.evaporateSpeed);
+            }
+        }
+        result.map = std::move(map);
+        return result;
+    }
+
+private:
+    const Erosion &parameters;
+};
+
+struct VerifyCase {
+    int width;
+    int height;
+    int radius;
+    int seed;
+    int droplets;
+    float inertia;
+    float erodeSpeed;
+};
+
+class Verifier {
+public:
+    explicit Verifier(const VerifyConfig &config) : config(config) {}
+
+    int checks = 0;
+    int failures = 0;
+
+    void check(bool passed, const std::string &what) {
+        checks++;
+        if (!passed) {
+            failures++;
+            std::cout << "  FAILED " << what << std::endl;
+        }
+    }
+
+    // The cache hands out one brush per key, also to eroders asking at once, and keeps to its capacity
+    void checkBrushCache() {
+        std::cout << "brush cache" << std::endl;
+        BrushCache cache;
+        HeightmapView small = {nullptr, 64, 64, 64};
+        HeightmapView large = {nullptr, 96, 80, 96};
+        std::vector<std::shared_ptr<const ErosionBrush>> shared(4);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < shared.size(); i++) {
+            threads.emplace_back([&, i] { shared[i] = cache.get(small, 3, HeightmapLayout::RowMajor); });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        bool same = std::all_of(shared.begin(), shared.end(), [&](const auto &brush) { return brush == shared[0]; });
+        check(same && cache.size() == 1, "brush cache builds one brush for eroders asking at once");
+
+        cache.setCapacity(shared[0]->memoryUsage());
+        std::shared_ptr<const ErosionBrush> held = cache.get(large, 3, HeightmapLayout::RowMajor);
+        check(cache.size() == 2, "brush cache keeps brushes eroders hold past its capacity");
+        shared.clear();
+        held.reset();
+        cache.get(small, 2, HeightmapLayout::RowMajor);
+        check(cache.memoryUsage() <= cache.capacity() && cache.size() == 1,
+              "brush cache evicts unused brushes beyond its capacity");
+    }
+
+    // Long pipe model runs keep the terrain within its initial range and no steeper than the talus slope allows
+    void checkPipeBounded() {
+        const int width = 96;
+        const int height = 80;
+        const int steps = 6000;
+        std::cout << "pipe model " << width << "x" << height << " steps " << steps << std::endl;
+        std::vector<float> map((size_t)width * height);
+        generateMapRegion(width, 0, 0, width, height, map.data(), width);
+        auto [lowest, highest] = std::minmax_element(map.begin(), map.end());
+        float initialLowest = *lowest;
+        float initialHighest = *highest;
+
+        PipeErosion pipes;
+        pipes.erode({map.data(), width, height, width}, steps, true);
+        pipes.settle({map.data(), width, height, width});
+        bool bounded = std::all_of(map.begin(), map.end(), [&](float h) {
+            return std::isfinite(h) && h >= initialLowest - 0.05f && h <= initialHighest + 0.05f;
+        });
+        float steepest = 0;
+        for (int y = 0; y + 1 < height; y++) {
+            for (int x = 0; x + 1 < width; x++) {
+                float h = map[(size_t)y * width + x];
+                steepest = std::max({steepest, std::abs(map[(size_t)y * width + x + 1] - h),
+                                     std::abs(map[(size_t)(y + 1) * width + x] - h)});
+            }
+        }
+        check(bounded, "pipe model keeps heights within the initial range");
+        check(steepest <= 2 * pipes.talusSlope / width, "pipe model keeps neighbors within twice the talus slope (" +
+              std::to_string(steepest) + ")");
+    }
+
+    // A pyramid of only full resolution is a plain erode call, deeper ones are deterministic and invalid ones refused
+    void checkPyramid() {
+        const int size = 128;
+        std::cout << "pyramid " << size << "x" << size << std::endl;
+        Heightmap initial(size, HeightmapLayout::RowMajor);
+        generateMap(&initial, 1);
+        std::vector<float> start = initial.toRowMajor();
+
+        Erosion plain;
+        plain.seed = 7;
+        std::vector<float> plainMap = start;
+        plain.erode(std::span<float>(plainMap), size, size, size, 20000, true);
+        Erosion single;
+        single.seed = 7;
+        std::vector<float> singleMap = start;
+        bool eroded = erodePyramid(single, {singleMap.data(), size, size, size}, {{1, 20000}}, true);
+        check(eroded && singleMap == plainMap, "pyramid of one full resolution level matches erode");
+
+        std::vector<PyramidLevel> levels = pyramidSchedule(200000, 3);
+        std::vector<std::vector<float>> maps(2, start);
+        for (std::vector<float> &map : maps) {
+            Erosion eroder;
+            eroder.seed = 7;
+            eroded = erodePyramid(eroder, {map.data(), size, size, size}, levels, true) && eroded;
+        }
+        bool finite = std::all_of(maps[0].begin(), maps[0].end(), [](float h) { return std::isfinite(h); });
+        check(eroded && finite && maps[0] == maps[1] && maps[0] != start, "pyramid of three levels is deterministic");
+
+        Erosion refused;
+        check(!erodePyramid(refused, {plainMap.data(), size, size, size}, {{1, 100}, {2, 100}}, true) &&
+              !erodePyramid(refused, {plainMap.data(), size, size, size}, {{128, 100}}, true),
+              "pyramid refuses rising scales and levels under 2 x 2 cells");
+    }
+
+    // One shard is the sequential scalar run, more are deterministic and conserve mass to float rounding. Forks, so
+    // it has to run while the verifier has no other threads
+    void checkSharding() {
+        const int width = 96;
+        const int height = 80;
+        const int droplets = 20000;
+        std::cout << "sharding " << width << "x" << height << std::endl;
+        std::vector<float> initial((size_t)width * height);
+        generateMapRegion(width, 0, 0, width, height, initial.data(), width);
+
+        Erosion sequential;
+        sequential.seed = 13;
+        std::vector<float> expected = initial;
+        sequential.erode(std::span<float>(expected), width, height, width, droplets, true);
+
+        auto shard = [&](int numShards, std::vector<float> &map, ErosionStats &stats) {
+            Erosion eroder;
+            eroder.seed = 13;
+            eroder.collectStats = true;
+            ShardOptions options;
+            options.numShards = numShards;
+            options.epochs = 4;
+            map = initial;
+            std::string error;
+            bool eroded = erodeSharded(eroder, {map.data(), width, height, width}, droplets, true, options, error);
+            stats = eroder.stats;
+            return eroded;
+        };
+        std::vector<float> single;
+        ErosionStats singleStats;
+        check(shard(1, single, singleStats) && single == expected, "one shard matches the sequential scalar run");
+
+        std::vector<std::vector<float>> maps(2);
+        ErosionStats stats[2];
+        bool eroded = shard(3, maps[0], stats[0]) && shard(3, maps[1], stats[1]);
+        check(eroded && maps[0] == maps[1] && maps[0] != initial, "three shards are deterministic");
+        checkMass("three shards", initial, maps[0], stats[0]);
+    }
+
+    // Frames read back as the means of the map cells they cover, also in the last row and column that cover
+    // fewer. A reader sees whether the publisher finished or exited without finishing. Forks like checkSharding
+    void checkSnapshotRing() {
+        const int size = 10;
+        std::cout << "snapshot ring " << size << "x" << size << std::endl;
+        std::string name = "hydraulic-erosion-verify-" + std::to_string(getpid()) + "-snapshots";
+        Heightmap map(size, HeightmapLayout::RowMajor);
+        std::vector<float> heights((size_t)size * size);
+        for (size_t i = 0; i < heights.size(); i++) {
+            heights[i] = (float)((i * 37) % 101) / 100;
+        }
+        map.fromRowMajor(heights);
+
+        SnapshotPublisher publisher;
+        SnapshotReader reader;
+        SnapshotFrame frame;
+        bool created = publisher.create(name, size, 4) && reader.open(name);
+        check(created && publisher.frameSize() == 4 && !reader.read(frame),
+              "snapshot ring of a 10 cell map filters to 4 cells across, no frame before the first");
+        publisher.publish(map, 300, 1000);
+        const int factor = 3;
+        bool means = reader.read(frame) && frame.frame == 0 && frame.droplets == 300 && frame.totalDroplets == 1000 &&
+                     frame.size == 4 && frame.heights.size() == 16;
+        for (int frameY = 0; means && frameY < 4; frameY++) {
+            for (int frameX = 0; means && frameX < 4; frameX++) {
+                double sum = 0;
+                int cells = 0;
+                for (int y = frameY * factor; y < std::min(size, (frameY + 1) * factor); y++) {
+                    for (int x = frameX * factor; x < std::min(size, (frameX + 1) * factor); x++) {
+                        sum += heights[(size_t)y * size + x];
+                        cells++;
+                    }
+                }
+                means = std::abs(frame.heights[frameY * 4 + frameX] - sum / cells) <= 1e-6;
+            }
+        }
+        check(means, "snapshot frame holds the means of the cells it covers, partial last row and column included");
+        check(!reader.finished() && !reader.publisherGone(), "snapshot reader waits while the publisher runs");
+        publisher.finish();
+        check(reader.finished() && !reader.publisherGone(), "snapshot reader sees the publisher finish");
+        reader.close();
+
+        // A publisher exiting without finishing or cleaning up, as a crashed run would
+        pid_t child = fork();
+        if (child == 0) {
+            SnapshotPublisher crashed;
+            if (crashed.create(name, size, 4)) {
+                crashed.publish(map, 0, 1000);
+            }
+            _exit(0);
+        }
+        waitpid(child, nullptr, 0);
+        check(reader.open(name) && !reader.finished() && reader.publisherGone(),
+              "snapshot reader sees a publisher that exited without finishing");
+        reader.close();
+        // publisher removes the name, which now belongs to the ring the child left behind, as it goes out of scope
+    }
+
+    // A run saved to a checkpoint file and resumed by a new eroder ends on the map of one uninterrupted run
+    void checkCheckpointResume() {
+        const int size = 96;
+        std::cout << "checkpoint resume " << size << "x" << size << std::endl;
+        std::string path = temporaryPath("checkpoint");
+        for (DropletSchedule schedule : {DropletSchedule::Sequential, DropletSchedule::Tiled, DropletSchedule::Binned}) {
+            Heightmap initial(size, HeightmapLayout::RowMajor);
+            generateMap(&initial, 1);
+            auto setUpRun = [&](Erosion &eroder) {
+                eroder.seed = 11;
+                eroder.schedule = schedule;
+                eroder.numThreads = schedule == DropletSchedule::Tiled ? 2 : 1;
+                eroder.parallelBatchSize = 4096;
+            };
+
+            Erosion whole;
+            setUpRun(whole);
+            Heightmap wholeMap(size, HeightmapLayout::RowMajor);
+            wholeMap.fromRowMajor(initial.toRowMajor());
+            whole.erode(&wholeMap, 20480, true);
+
+            Erosion first;
+            setUpRun(first);
+            Heightmap firstMap(size, HeightmapLayout::RowMajor);
+            firstMap.fromRowMajor(initial.toRowMajor());
+            first.erode(&firstMap, 8192, true);
+            ErosionCheckpoint saved;
+            saved.capture(first);
+            saved.totalDroplets = 20480;
+            saved.mapSize = size;
+            saved.map = firstMap.toRowMajor();
+
+            ErosionCheckpoint loaded;
+            bool roundTrip = saveCheckpoint(path, saved) && loadCheckpoint(path, loaded);
+            Erosion resumed;
+            roundTrip = roundTrip && loaded.restore(resumed);
+            Heightmap resumedMap(size, HeightmapLayout::RowMajor);
+            resumedMap.fromRowMajor(loaded.map);
+            resumed.erode(&resumedMap, (int)(loaded.totalDroplets - resumed.dropletCursor));
+            check(roundTrip && resumedMap.toRowMajor() == wholeMap.toRowMajor(),
+                  std::string("checkpoint resume of the ") +
+                  (schedule == DropletSchedule::Tiled ? "tiled" : schedule == DropletSchedule::Binned ? "binned"
+                                                                                                       : "sequential") +
+                  " schedule matches one run");
+        }
+        std::filesystem::remove(path);
+
+        // Auto never resolves to itself, so it stands in for a kernel this CPU lacks
+        ErosionCheckpoint foreign;
+        foreign.kernel = ErosionKernel::Auto;
+        foreign.parallelBatchSize = 4096;
+        Erosion refused;
+        check(!foreign.restore(refused), "checkpoint restore refuses a kernel the CPU doesn't run");
+    }
+
+    // Maps written as TIFFs read back the same, also across tiles cut off by the map edge. 16 bit images
+    // quantize and clamp to [0, 1]
+    void checkImageRoundTrip() {
+        const int size = 150;
+        std::cout << "image round trip " << size << "x" << size << std::endl;
+        Heightmap map(size, HeightmapLayout::RowMajor);
+        generateMap(&map, 1);
+        std::vector<float> heights = map.toRowMajor();
+        std::string path = temporaryPath("image.tif");
+        auto reader = [&](const std::vector<float> &source) {
+            return [&source](int x, int y, int width, int height, float* out, size_t stride) {
+                for (int row = 0; row < height; row++) {
+                    std::copy_n(&source[(size_t)(y + row) * size + x], width, out + row * stride);
+                }
+            };
+        };
+        auto readBack = [&](std::vector<float> &result) { return readImage(path, size, result); };
+
+        for (TiffCompression compression : {TiffCompression::None, TiffCompression::Deflate}) {
+            std::string name = compression == TiffCompression::None ? "uncompressed" : "deflate";
+            TiffOptions options;
+            options.compression = compression;
+            options.format = TiffSampleFormat::Float32;
+            options.tileSize = 64;
+            options.numThreads = 2;
+            std::vector<float> result;
+            bool written = writeTiledImage(path.c_str(), size, reader(heights), options);
+            check(written && readBack(result) && result == heights, name + " float32 image reads back the same");
+        }
+
+        // Out of range heights clamp to the ends of the 16 bit range instead of wrapping around
+        std::vector<float> outOfRange = heights;
+        outOfRange[0] = -0.25f;
+        outOfRange[1] = 1.25f;
+        outOfRange[2] = 0;
+        outOfRange[3] = 1;
+        TiffOptions options;
+        options.tileSize = 64;
+        std::vector<float> result;
+        bool written = writeTiledImage(path.c_str(), size, reader(outOfRange), options);
+        bool close = written && readBack(result);
+        for (size_t i = 0; close && i < result.size(); i++) {
+            close = std::abs(result[i] - std::clamp(outOfRange[i], 0.0f, 1.0f)) <= 1.0f / UINT16_MAX;
+        }
+        check(close && result[0] == 0 && result[1] == 1, "uint16 image reads back within one step, clamped");
+        std::filesystem::remove(path);
+    }
+
+    // Raw inputs of either sample format are scaled from their lowest to their highest height unless the raw range
+    // is asked for. Cells without data are left out of the range and get the lowest height
+    void checkRawInput() {
+        const int size = 40;
+        std::cout << "raw input " << size << "x" << size << std::endl;
+        std::string path = temporaryPath("input.raw");
+        std::vector<float> dem((size_t)size * size);
+        for (size_t i = 0; i < dem.size(); i++) {
+            dem[i] = 100 + (float)((i * 7919) % 1000);
+        }
+        std::vector<size_t> voids = {5, 7, 9};
+        dem[voids[0]] = NAN;
+        dem[voids[1]] = -9999;
+        dem[voids[2]] = -32768;
+        auto isVoid = [&](size_t i) { return std::find(voids.begin(), voids.end(), i) != voids.end(); };
+        std::ofstream(path, std::ios::binary).write((const char*)dem.data(), dem.size() * sizeof(float));
+        MapInput input;
+        std::string error;
+        Heightmap map(size, HeightmapLayout::RowMajor);
+        bool read = input.open(path, MapInputFormat::RawFloat32, error) && input.read(&map);
+        std::vector<float> heights = map.toRowMajor();
+        bool scaled = read;
+        for (size_t i = 0; scaled && i < heights.size(); i++) {
+            scaled = isVoid(i) ? heights[i] == 0 : std::abs(heights[i] - (dem[i] - 100) / 999) <= 1e-6f;
+        }
+        check(scaled, "raw float32 input is scaled from its lowest to its highest height, voids filled with 0");
+
+        input.range = MapInputRange::Raw;
+        read = input.read(&map);
+        heights = map.toRowMajor();
+        bool kept = read;
+        for (size_t i = 0; kept && i < heights.size(); i++) {
+            kept = heights[i] == (isVoid(i) ? 100 : dem[i]);
+        }
+        check(kept, "raw float32 input keeps its heights in the raw range, voids filled with the lowest");
+        input.close();
+
+        std::vector<uint16_t> samples(dem.size());
+        for (size_t i = 0; i < samples.size(); i++) {
+            samples[i] = (uint16_t)(i * 40503);
+        }
+        auto [lowest, highest] = std::minmax_element(samples.begin(), samples.end());
+        std::ofstream(path, std::ios::binary).write((const char*)samples.data(), samples.size() * sizeof(uint16_t));
+        MapInput unsignedInput;
+        read = unsignedInput.open(path, MapInputFormat::RawUInt16, error) && unsignedInput.read(&map);
+        heights = map.toRowMajor();
+        scaled = read;
+        for (size_t i = 0; scaled && i < heights.size(); i++) {
+            scaled = std::abs(heights[i] - (float)(samples[i] - *lowest) / (*highest - *lowest)) <= 1e-6f;
+        }
+        check(scaled, "raw uint16 input is scaled from its lowest to its highest sample");
+
+        unsignedInput.range = MapInputRange::Raw;
+        read = unsignedInput.read(&map);
+        heights = map.toRowMajor();
+        kept = read;
+        for (size_t i = 0; kept && i < heights.size(); i++) {
+            kept = std::abs(heights[i] - samples[i] / (float)UINT16_MAX) <= 1e-6f;
+        }
+        check(kept, "raw uint16 input in the raw range is scaled from its full range");
+        unsignedInput.close();
+
+        std::fill(dem.begin(), dem.end(), NAN);
+        std::ofstream(path, std::ios::binary).write((const char*)dem.data(), dem.size() * sizeof(float));
+        check(input.open(path, MapInputFormat::RawFloat32, error) && !input.read(&map),
+              "raw input without any data is refused");
+        input.close();
+        std::filesystem::remove(path);
+    }
+
+    // A manifest reads back the jobs it lists and refuses numbers with anything after them. Every job of a batch
+    // ends on the map of eroding it on its own, whatever order the jobs are listed in
+    void checkBatchManifest() {
+        std::cout << "batch manifest" << std::endl;
+        std::string path = temporaryPath("manifest.csv");
+        std::vector<std::string> outputs = {temporaryPath("batch-0.tif"), temporaryPath("batch-1.tif"),
+                                            temporaryPath("batch-2.tif")};
+        std::ofstream(path) << "output, resolution, iterations, seed, erosionRadius, inertia\n"
+                            << "# larger map first\n"
+                            << outputs[0] << ", 48, 3000, 5, , \n"
+                            << "\n"
+                            << outputs[1] << ", 32, 2000, , 2, 0.25\n"
+                            << outputs[2] << ", 48, 2500, 6, 4, \n";
+        std::vector<BatchJob> jobs;
+        std::string error;
+        bool loaded = loadBatchManifest(path, jobs, error);
+        check(loaded && jobs.size() == 3 && jobs[0].output == outputs[0] && jobs[0].resolution == 48 &&
+              jobs[0].iterations == 3000 && jobs[0].seed == 5 && jobs[0].parameters.empty() &&
+              jobs[1].seed == BatchJob().seed && jobs[1].parameters.size() == 2 &&
+              jobs[1].parameters[1].second == 0.25f &&
+              jobs[2].parameters.size() == 1 && jobs[2].parameters[0].second == 4,
+              "batch manifest reads back the jobs it lists");
+
+        BatchOptions options;
+        options.numThreads = 2;
+        options.image.format = TiffSampleFormat::Float32;
+        bool matches = loaded && runBatch(jobs, options);
+        for (const BatchJob &job : jobs) {
+            Erosion eroder;
+            job.apply(eroder);
+            std::vector<float> map = generateMap(job.resolution);
+            eroder.erode(std::span<float>(map), job.resolution, job.resolution, job.resolution, job.iterations, true);
+            std::vector<float> written;
+            matches = matches && readImage(job.output, job.resolution, written) && written == map;
+            std::filesystem::remove(job.output);
+        }
+        check(matches, "batch jobs match eroding each map on its own");
+
+        std::ofstream(path) << "output,resolution,iterations\n"
+                            << outputs[0] << ",32,2000\n"
+                            << outputs[1] << ",32x,2000\n";
+        bool refused = !loadBatchManifest(path, jobs, error) && error.rfind(path + ":3:", 0) == 0;
+        std::ofstream(path) << "output,resolution,iterations,inertia\n" << outputs[0] << ",32,2000,0.5.1\n";
+        refused = refused && !loadBatchManifest(path, jobs, error) && error.rfind(path + ":2:", 0) == 0;
+        check(refused, "batch manifest refuses numbers with text after them at path:line");
+        std::filesystem::remove(path);
+    }
+
+    void run(const VerifyCase &test) {
+        std::cout << "case " << test.width << "x" << test.height << " radius " << test.radius << " seed " << test.seed
+                  << " droplets " << test.droplets << std::endl;
+        std::vector<float> initial((size_t)test.width * test.height);
+        generateMapRegion(std::max(test.width, test.height), 0, 0, test.width, test.height, initial.data(), test.width);
+
+        Erosion parameters;
+        setUp(parameters, test);
+        ReferenceErosion reference(parameters);
+        ReferenceResult expected = reference.erode(initial, test.width, test.height, test.droplets);
+        // Another seed erodes the same landscape with droplets unrelated to these, how far that lands from the
+        // reference is what an unrelated result looks like
+        Erosion reseeded;
+        setUp(reseeded, test);
+        reseeded.seed = test.seed ^ 0x5bd1e995;
+        double unrelated = rmsDifference(ReferenceErosion(reseeded).erode(initial, test.width, test.height,
+                                                                          test.droplets).map, expected.map);
+
+        checkHeightAndGradient(test, initial, reference);
+
+        // Scalar kernel on a map with padded rows, droplet for droplet the reference
+        int stride = test.width + 3;
+        std::vector<float> padded((size_t)stride * test.height, -1.0f);
+        for (int y = 0; y < test.height; y++) {
+            std::copy_n(&initial[(size_t)y * test.width], test.width, &padded[(size_t)y * stride]);
+        }
+        Erosion scalar;
+        setUp(scalar, test);
+        scalar.collectStats = true;
+        scalar.erode(std::span<float>(padded), test.width, test.height, stride, test.droplets, true);
+        std::vector<float> unpadded((size_t)test.width * test.height);
+        bool paddingKept = true;
+        for (int y = 0; y < test.height; y++) {
+            std::copy_n(&padded[(size_t)y * stride], test.width, &unpadded[(size_t)y * test.width]);
+            paddingKept = paddingKept && (y == test.height - 1 || std::all_of(&padded[(size_t)y * stride + test.width],
+                                          &padded[(size_t)(y + 1) * stride], [](float h) { return h == -1.0f; }));
+        }
+        check(unpadded == expected.map, "scalar kernel matches the reference");
+        check(paddingKept, "scalar kernel leaves the row padding alone");
+        check(scalar.stats.sedimentEroded == expected.eroded && scalar.stats.sedimentDeposited == expected.deposited,
+              "scalar stats match the sediment the reference moved");
+        checkMass("scalar", initial, unpadded, scalar.stats);
+
+        // A band of every row is the scalar kernel, droplets handed between two bands all finish in one of them
+        std::vector<DropletState> none;
+        std::vector<DropletState> leaving;
+        Erosion whole;
+        setUp(whole, test);
+        std::vector<float> wholeMap = initial;
+        whole.erodeRows({wholeMap.data(), test.width, test.height, test.width}, 0, test.height, none, leaving,
+                        test.droplets, true);
+        check(wholeMap == expected.map && leaving.empty(), "erodeRows over every row matches the reference");
+        checkBands(test, initial);
+
+        if (test.width == test.height) {
+            Heightmap blocked(test.width, HeightmapLayout::Blocked);
+            blocked.fromRowMajor(initial);
+            Erosion blockedEroder;
+            setUp(blockedEroder, test);
+            blockedEroder.erode(&blocked, test.droplets, true);
+            check(blocked.toRowMajor() == expected.map, "blocked layout matches the reference");
+        }
+
+        for (ErosionKernel kernel :
+             {ErosionKernel::Scalar, ErosionKernel::Sse, ErosionKernel::Avx2, ErosionKernel::Avx512}) {
+            Erosion probe;
+            probe.kernel = kernel;
+            if (probe.resolveKernel() != kernel) {
+                continue;
+            }
+            std::string name = erosionKernelName(kernel);
+            if (kernel != ErosionKernel::Scalar) {
+                Erosion packets;
+                setUp(packets, test);
+                packets.kernel = kernel;
+                packets.collectStats = true;
+                std::vector<float> map = initial;
+                packets.erode(std::span<float>(map), test.width, test.height, test.width, test.droplets, true);
+                checkClose(name + " kernel", map, packets.stats, expected, unrelated);
+                checkMass(name + " kernel", initial, map, packets.stats);
+
+                // Split where splitAlignment allows, whatever parallelBatchSize is
+                Erosion split;
+                setUp(split, test);
+                split.kernel = kernel;
+                split.parallelBatchSize = std::max(1, test.droplets / 3);
+                int first = (int)(test.droplets / split.splitAlignment() * split.splitAlignment());
+                std::vector<float> splitMap = initial;
+                split.erode(std::span<float>(splitMap), test.width, test.height, test.width, first, true);
+                split.erode(std::span<float>(splitMap), test.width, test.height, test.width, test.droplets - first);
+                check(splitMap == map, name + " kernel split at splitAlignment matches one run");
+            }
+
+            // The tiled schedule gives the same map for every thread count
+            std::vector<float> tiledMap;
+            for (int threads : {1, 2, 3, 4}) {
+                Erosion tiled;
+                setUp(tiled, test);
+                tiled.kernel = kernel;
+                tiled.schedule = DropletSchedule::Tiled;
+                tiled.numThreads = threads;
+                tiled.parallelBatchSize = std::max(1, test.droplets / 3);
+                tiled.collectStats = true;
+                std::vector<float> map = initial;
+                tiled.erode(std::span<float>(map), test.width, test.height, test.width, test.droplets, true);
+                if (threads == 1) {
+                    tiledMap = map;
+                    checkClose("tiled " + name, map, tiled.stats, expected, unrelated);
+                    checkMass("tiled " + name, initial, map, tiled.stats);
+                } else {
+                    check(map == tiledMap, "tiled " + name + " on " + std::to_string(threads) +
+                                           " threads matches 1 thread");
+                }
+            }
+
+            // The binned schedule gives the same map when a run is split at a batch boundary
+            Erosion binned;
+            setUp(binned, test);
+            binned.kernel = kernel;
+            binned.schedule = DropletSchedule::Binned;
+            binned.parallelBatchSize = std::max(1, test.droplets / 3);
+            binned.collectStats = true;
+            std::vector<float> binnedMap = initial;
+            binned.erode(std::span<float>(binnedMap), test.width, test.height, test.width, test.droplets, true);
+            checkClose("binned " + name, binnedMap, binned.stats, expected, unrelated);
+            checkMass("binned " + name, initial, binnedMap, binned.stats);
+            std::vector<float> splitMap = initial;
+            binned.erode(std::span<float>(splitMap), test.width, test.height, test.width, binned.parallelBatchSize,
+                         true);
+            binned.erode(std::span<float>(splitMap), test.width, test.height, test.width,
+                         test.droplets - binned.parallelBatchSize);
+            check(splitMap == binnedMap, "binned " + name + " split at a batch matches one run");
+        }
+    }
+
+private:
+    const VerifyConfig &config;
+
+    static std::string temporaryPath(const std::string &name) {
+        return (std::filesystem::temp_directory_path() /
+                ("hydraulic-erosion-verify-" + std::to_string(getpid()) + "-" + name)).string();
+    }
+
+    static bool readImage(const std::string &path, int size, std::vector<float> &result) {
+        MapInput input;
+        input.range = MapInputRange::Raw;
+        std::string error;
+        Heightmap back(size, HeightmapLayout::RowMajor);
+        if (!input.open(path, MapInputFormat::Tiff, error) || input.size() != size || !input.read(&back)) {
+            return false;
+        }
+        result = back.toRowMajor();
+        return true;
+    }
+
+    static void setUp(Erosion &eroder, const VerifyCase &test) {
+        eroder.seed = test.seed;
+        eroder.erosionRadius = test.radius;
+        eroder.inertia = test.inertia;
+        eroder.erodeSpeed = test.erodeSpeed;
+    }
+
+    static double rmsDifference(const std::vector<float> &a, const std::vector<float> &b) {
+        double sum = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            sum += ((double)a[i] - b[i]) * ((double)a[i] - b[i]);
+        }
+        return std::sqrt(sum / a.size());
+    }
+
+    void checkBands(const VerifyCase &test, const std::vector<float> &initial) {
+        std::vector<float> map = initial;
+        HeightmapView view = {map.data(), test.width, test.height, test.width};
+        int middle = test.height / 2;
+        Erosion bands[2];
+        int firstRow[2] = {0, middle};
+        int endRow[2] = {middle, test.height};
+        std::vector<DropletState> arriving[2];
+        ErosionStats total;
+        total.reset();
+        for (int round = 0; round == 0 || !arriving[0].empty() || !arriving[1].empty(); round++) {
+            std::vector<DropletState> leaving[2];
+            for (int band = 0; band < 2; band++) {
+                setUp(bands[band], test);
+                bands[band].collectStats = true;
+                bands[band].erodeRows(view, firstRow[band], endRow[band], arriving[band], leaving[band],
+                                      round == 0 ? test.droplets : 0, round == 0);
+                total.merge(bands[band].stats);
+            }
+            arriving[0] = std::move(leaving[1]);
+            arriving[1] = std::move(leaving[0]);
+        }
+        check(total.droplets == test.droplets, "every droplet handed between bands finishes");
+        checkMass("bands", initial, map, total);
+    }
+
+    void checkHeightAndGradient(const VerifyCase &test, std::vector<float> &map, const ReferenceErosion &reference) {
+        Erosion eroder;
+        HeightmapView view = {map.data(), test.width, test.height, test.width};
+        std::mt19937 random(test.seed);
+        std::uniform_real_distribution<float> x(0, std::nextafter((float)(test.width - 1), 0.0f));
+        std::uniform_real_distribution<float> y(0, std::nextafter((float)(test.height - 1), 0.0f));
+        bool same = true;
+        for (int i = 0; i < 1000; i++) {
+            float posX = x(random);
+            float posY = y(random);
+            HeightAndGradient actual = eroder.calculateHeightAndGradient(view, posX, posY);
+            HeightAndGradient wanted = reference.sample(map, test.width, posX, posY);
+            same = same && actual.height == wanted.height && actual.gradientX == wanted.gradientX &&
+                   actual.gradientY == wanted.gradientY;
+        }
+        check(same, "calculateHeightAndGradient matches the reference");
+    }
+
+    void checkClose(const std::string &name, const std::vector<float> &map, const ErosionStats &stats,
+                    const ReferenceResult &expected, double unrelated) {
+        double error = rmsDifference(map, expected.map) / std::max(unrelated, 1e-12);
+        bool finite = std::all_of(map.begin(), map.end(), [](float h) { return std::isfinite(h); });
+        check(finite && error <= config.tolerance,
+              name + " stays close to the reference (" + std::to_string(error) +
+              " of the difference another seed makes)");
+        double erodedError = std::abs(stats.sedimentEroded / std::max(expected.eroded, 1e-12) - 1);
+        double depositedError = std::abs(stats.sedimentDeposited / std::max(expected.deposited, 1e-12) - 1);
+        check(erodedError <= config.sedimentTolerance && depositedError <= config.sedimentTolerance,
+              name + " moves as much sediment as the reference (eroded " + std::to_string(erodedError) +
+              " and deposited " + std::to_string(depositedError) + " off)");
+    }
+
+    // Heights only change by sediment taken up and put down, what droplets still carry when they stop is gone
+    void checkMass(const std::string &name, const std::vector<float> &initial, const std::vector<float> &map,
+                   const ErosionStats &stats) {
+        double before = 0;
+        double after = 0;
+        for (size_t i = 0; i < map.size(); i++) {
+            before += initial[i];
+            after += map[i];
+        }
+        double expected = stats.sedimentDeposited - stats.sedimentEroded;
+        double allowed = 1e-4 * (stats.sedimentDeposited + stats.sedimentEroded) + 1e-6 * map.size();
+        check(std::abs((after - before) - expected) <= allowed, name + " conserves mass (map changed by " +
+              std::to_string(after - before) + ", sediment by " + std::to_string(expected) + ")");
+    }
+};
+
+int main(int argc, char* argv[]) {
+    const char* usage = "Usage is ./Hydraulic-Erosion-verify [--quick] [--cases <count>] [--seed <seed>] "
+                        "[--max-size <size>] [--tolerance <error>] [--sediment-tolerance <fraction>]";
+
+    VerifyConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--quick") {
+            config.cases = 6;
+            config.maxSize = 160;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[++i];
+
+        if (option == "--cases") {
+            config.cases = std::max(1, atoi(value.c_str()));
+        } else if (option == "--seed") {
+            config.seed = (unsigned)atoll(value.c_str());
+        } else if (option == "--max-size") {
+            config.maxSize = std::max(config.minSize, atoi(value.c_str()));
+        } else if (option == "--tolerance") {
+            config.tolerance = atof(value.c_str());
+        } else if (option == "--sediment-tolerance") {
+            config.sedimentTolerance = atof(value.c_str());
+        } else {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Radii 1 to 8 have their own scalar kernels, larger ones run the generic one
+    std::mt19937 random(config.seed);
+    std::uniform_int_distribution<int> size(config.minSize, config.maxSize);
+    std::uniform_int_distribution<int> radius(1, 10);
+    std::uniform_real_distribution<float> inertia(0.0f, 0.3f);
+    std::uniform_real_distribution<float> erodeSpeed(0.1f, 0.5f);
+    Verifier verifier(config);
+    for (int i = 0; i < config.cases; i++) {
+        VerifyCase test;
+        test.width = size(random);
+        // Every other map is square so the blocked layout gets checked too
+        test.height = i % 2 == 0 ? test.width : size(random);
+        test.radius = radius(random);
+        test.seed = (int)(random() & 0x7fffffff);
+        test.droplets = std::max(1, (int)(test.width * test.height * config.density));
+        test.inertia = inertia(random);
+        test.erodeSpeed = erodeSpeed(random);
+        verifier.run(test);
+    }
+    verifier.checkSharding();
+    verifier.checkSnapshotRing();
+    verifier.checkBrushCache();
+    verifier.checkPipeBounded();
+    verifier.checkPyramid();
+    verifier.checkCheckpointResume();
+    verifier.checkImageRoundTrip();
+    verifier.checkRawInput();
+    verifier.checkBatchManifest();
+
+    std::cout << verifier.checks - verifier.failures << " of " << verifier.checks << " checks passed" << std::endl;
+    return verifier.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -27,6 +27,8 @@ public:
     float fractal(size_t octaves, float x) const;
     float fractal(size_t octaves, float x, float y) const;
     float fractal(size_t octaves, float x, float y, float z) const;
+    // 2D fBm of count samples at once, vectorized across samples
+    void fractal(size_t octaves, size_t count, const float* x, const float* y, float* output) const;
 
     /**
      * Constructor of to initialize a fractal noise summation
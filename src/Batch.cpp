@@ -0,0 +1,281 @@
+#include "Batch.hpp"
+#include "BoundedQueue.hpp"
+#include "MapGenerator.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+struct FloatParameter {
+    const char* name;
+    float Erosion::* member;
+};
+
+static const FloatParameter floatParameters[] = {
+    {"inertia", &Erosion::inertia},
+    {"sedimentCapacityFactor", &Erosion::sedimentCapacityFactor},
+    {"minSedimentCapacity", &Erosion::minSedimentCapacity},
+    {"erodeSpeed", &Erosion::erodeSpeed},
+    {"depositSpeed", &Erosion::depositSpeed},
+    {"evaporateSpeed", &Erosion::evaporateSpeed},
+    {"gravity", &Erosion::gravity},
+    {"maxDropletLifetime", &Erosion::maxDropletLifetime},
+    {"initialWaterVolume", &Erosion::initialWaterVolume},
+    {"initialSpeed", &Erosion::initialSpeed},
+};
+
+static bool isParameter(const std::string &name) {
+    return name == "erosionRadius" || std::any_of(std::begin(floatParameters), std::end(floatParameters),
+                                                  [&](const FloatParameter &parameter) { return name == parameter.name; });
+}
+
+void BatchJob::apply(Erosion &eroder) const {
+    static const Erosion defaults = Erosion();
+    eroder.erosionRadius = defaults.erosionRadius;
+    for (const FloatParameter &parameter : floatParameters) {
+        eroder.*parameter.member = defaults.*parameter.member;
+    }
+    for (const auto &[name, value] : parameters) {
+        if (name == "erosionRadius") {
+            eroder.erosionRadius = (int)value;
+        }
+        for (const FloatParameter &parameter : floatParameters) {
+            if (name == parameter.name) {
+                eroder.*parameter.member = value;
+            }
+        }
+    }
+    eroder.seed = seed;
+}
+
+static std::string trim(const std::string &text) {
+    size_t first = text.find_first_not_of(" \t\r");
+    size_t last = text.find_last_not_of(" \t\r");
+    return first == std::string::npos ? std::string() : text.substr(first, last - first + 1);
+}
+
+// Whole field as a number, trailing text or values out of range are errors
+static bool parseInteger(const std::string &field, int &value) {
+    char* end = nullptr;
+    errno = 0;
+    long parsed = strtol(field.c_str(), &end, 10);
+    if (end == field.c_str() || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX) {
+        return false;
+    }
+    value = (int)parsed;
+    return true;
+}
+
+static bool parseFloat(const std::string &field, float &value) {
+    char* end = nullptr;
+    errno = 0;
+    value = strtof(field.c_str(), &end);
+    return end != field.c_str() && *end == '\0' && errno != ERANGE && std::isfinite(value);
+}
+
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    std::istringstream in(line);
+    std::string field;
+    while (std::getline(in, field, ',')) {
+        fields.push_back(trim(field));
+    }
+    if (!line.empty() && line.back() == ',') {
+        fields.emplace_back();
+    }
+    return fields;
+}
+
+bool loadBatchManifest(const std::string &path, std::vector<BatchJob> &jobs, std::string &error) {
+    jobs.clear();
+    std::ifstream in(path);
+    if (!in) {
+        error = "Could not read " + path;
+        return false;
+    }
+
+    std::vector<std::string> columns;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        std::string content = trim(line);
+        if (content.empty() || content[0] == '#') {
+            continue;
+        }
+        std::vector<std::string> fields = splitFields(content);
+        std::string where = path + ":" + std::to_string(lineNumber) + ": ";
+
+        if (columns.empty()) {
+            columns = fields;
+            for (const char* required : {"output", "resolution", "iterations"}) {
+                if (std::find(columns.begin(), columns.end(), required) == columns.end()) {
+                    error = where + "no " + required + " column";
+                    return false;
+                }
+            }
+            for (const std::string &column : columns) {
+                if (column != "output" && column != "resolution" && column != "iterations" && column != "seed" &&
+                    !isParameter(column)) {
+                    error = where + "unknown column " + column;
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (fields.size() != columns.size()) {
+            error = where + "expected " + std::to_string(columns.size()) + " fields";
+            return false;
+        }
+        BatchJob job;
+        for (size_t i = 0; i < columns.size(); i++) {
+            const std::string &value = fields[i];
+            if (value.empty()) {
+                continue;
+            }
+            bool parsed = true;
+            if (columns[i] == "output") {
+                job.output = value;
+            } else if (columns[i] == "resolution") {
+                parsed = parseInteger(value, job.resolution);
+            } else if (columns[i] == "iterations") {
+                parsed = parseInteger(value, job.iterations);
+            } else if (columns[i] == "seed") {
+                parsed = parseInteger(value, job.seed);
+            } else {
+                float number;
+                parsed = parseFloat(value, number);
+                job.parameters.emplace_back(columns[i], number);
+            }
+            if (!parsed) {
+                error = where + columns[i] + " " + value + " is not a number";
+                return false;
+            }
+        }
+        if (job.output.empty() || job.resolution < 2 || job.iterations < 0) {
+            error = where + "needs an output, a resolution of at least 2 and iterations";
+            return false;
+        }
+        jobs.push_back(std::move(job));
+    }
+    if (columns.empty()) {
+        error = path + " has no header line";
+        return false;
+    }
+    return true;
+}
+
+namespace {
+// A map buffer going through the stages, recycled once its image is written
+struct BatchMap {
+    const BatchJob* job = nullptr;
+    std::vector<float> cells;
+};
+}
+
+// Runs jobs through the generate, erode and write stages at once: while numEroders threads erode, one thread
+// generates the noise of the next maps and the calling thread writes the finished ones. Only numEroders + 2
+// maps exist at a time, generating waits for a written map to take its buffer over
+static bool runStages(const std::vector<const BatchJob*> &jobs, const BatchOptions &options, int numEroders,
+                      int threadsPerMap) {
+    if (jobs.empty()) {
+        return true;
+    }
+    int numMaps = numEroders + 2;
+    BoundedQueue<std::unique_ptr<BatchMap>> freeMaps(numMaps);
+    BoundedQueue<std::unique_ptr<BatchMap>> generated(numMaps);
+    BoundedQueue<std::unique_ptr<BatchMap>> eroded(numMaps);
+    for (int i = 0; i < numMaps; i++) {
+        freeMaps.push(std::make_unique<BatchMap>());
+    }
+
+    std::thread generator([&]() {
+        // The noise only depends on the resolution, jobs are sorted so each one is generated once
+        ThreadPool pool(threadsPerMap);
+        std::vector<float> noise;
+        int noiseResolution = 0;
+        for (const BatchJob* job : jobs) {
+            std::unique_ptr<BatchMap> map = *freeMaps.pop();
+            if (job->resolution != noiseResolution) {
+                noiseResolution = job->resolution;
+                noise.resize((size_t)noiseResolution * noiseResolution);
+                generateMapRegion(noiseResolution, 0, 0, noiseResolution, noiseResolution, noise.data(),
+                                  noiseResolution, &pool);
+            }
+            map->job = job;
+            map->cells.assign(noise.begin(), noise.end());
+            generated.push(std::move(map));
+        }
+        generated.close();
+    });
+
+    std::atomic<int> runningEroders = numEroders;
+    std::vector<std::thread> eroders;
+    for (int i = 0; i < numEroders; i++) {
+        eroders.emplace_back([&]() {
+            // Kept from job to job, with its brush and thread pool
+            Erosion eroder;
+            while (std::optional<std::unique_ptr<BatchMap>> map = generated.pop()) {
+                const BatchJob &job = *(*map)->job;
+                job.apply(eroder);
+                eroder.numThreads = threadsPerMap;
+                eroder.schedule = threadsPerMap > 1 ? DropletSchedule::Tiled : DropletSchedule::Sequential;
+                eroder.kernel = options.kernel;
+                eroder.erode(std::span<float>((*map)->cells), job.resolution, job.resolution, job.resolution,
+                             job.iterations, true);
+                eroded.push(std::move(*map));
+            }
+            if (--runningEroders == 0) {
+                eroded.close();
+            }
+        });
+    }
+
+    bool allWritten = true;
+    TiffOptions image = options.image;
+    image.numThreads = threadsPerMap;
+    while (std::optional<std::unique_ptr<BatchMap>> map = eroded.pop()) {
+        const BatchJob &job = *(*map)->job;
+        const float* cells = (*map)->cells.data();
+        bool written = writeTiledImage(job.output.c_str(), job.resolution,
+                                       [&](int x, int y, int width, int height, float* out, size_t stride) {
+            for (int row = 0; row < height; row++) {
+                std::copy_n(cells + (size_t)(y + row) * job.resolution + x, width, out + row * stride);
+            }
+        }, image);
+        if (!written) {
+            std::cout << "Could not write " << job.output << std::endl;
+            allWritten = false;
+        }
+        freeMaps.push(std::move(*map));
+    }
+
+    generator.join();
+    for (std::thread &eroder : eroders) {
+        eroder.join();
+    }
+    return allWritten;
+}
+
+bool runBatch(const std::vector<BatchJob> &jobs, const BatchOptions &options) {
+    std::vector<const BatchJob*> smallJobs;
+    std::vector<const BatchJob*> largeJobs;
+    for (const BatchJob &job : jobs) {
+        (job.resolution <= options.jobParallelSize ? smallJobs : largeJobs).push_back(&job);
+    }
+    auto byResolution = [](const BatchJob* a, const BatchJob* b) { return a->resolution < b->resolution; };
+    std::stable_sort(smallJobs.begin(), smallJobs.end(), byResolution);
+    std::stable_sort(largeJobs.begin(), largeJobs.end(), byResolution);
+
+    bool smallWritten = runStages(smallJobs, options, options.numThreads, 1);
+    bool largeWritten = runStages(largeJobs, options, 1, options.numThreads);
+    return smallWritten && largeWritten;
+}
@@ -0,0 +1,46 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "Erosion.hpp"
+#include "TiffWriter.hpp"
+
+// One map of a batch: the generated map of resolution x resolution cells eroded with iterations droplets
+struct BatchJob {
+    std::string output;
+    int resolution = 0;
+    int iterations = 0;
+    int seed = 1231204;
+    // Droplet parameters set for this job by name, the others keep the defaults of Erosion
+    std::vector<std::pair<std::string, float>> parameters;
+
+    // Sets every droplet parameter and the seed of eroder for this job
+    void apply(Erosion &eroder) const;
+};
+
+// Reads a CSV manifest. The first line names the columns: output, resolution and iterations are required,
+// seed and the droplet parameters of Erosion (erosionRadius, inertia, ...) are optional and empty cells keep
+// the default. Blank lines and lines starting with # are skipped, fields can't contain commas and numbers have
+// to be the whole field. On failure error says what was wrong, starting with path:line for a wrong line
+bool loadBatchManifest(const std::string &path, std::vector<BatchJob> &jobs, std::string &error);
+
+struct BatchOptions {
+    int numThreads = 1;
+    ErosionKernel kernel = ErosionKernel::Scalar;
+    TiffOptions image;
+    // Maps up to this resolution run one per thread on the sequential schedule, larger ones one after another
+    // on every thread. Which of the two a job runs on decides its result, the job order doesn't
+    int jobParallelSize = 1024;
+};
+
+// Runs every job, small maps first, as a pipeline: noise generation, erosion and writing the image run on their
+// own threads and overlap between maps, with a fixed set of map buffers recycled. The noise of each resolution
+// is generated once and every eroding thread keeps its eroder from job to job. Prints jobs whose image couldn't
+// be written and returns false if there were any
+bool runBatch(const std::vector<BatchJob> &jobs, const BatchOptions &options);
+
+
+#endif
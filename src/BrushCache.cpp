@@ -0,0 +1,111 @@
+#include "BrushCache.hpp"
+
+BrushCache& BrushCache::shared() {
+    static BrushCache cache;
+    return cache;
+}
+
+std::shared_ptr<const ErosionBrush> BrushCache::get(const HeightmapView& map, int radius, HeightmapLayout layout) {
+    Key key(map.width, map.height, map.stride, radius, layout);
+    std::promise<std::shared_ptr<const ErosionBrush>> built;
+    std::shared_future<std::shared_ptr<const ErosionBrush>> pending;
+    bool building = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry& entry = brushes[key];
+        entry.lastUse = ++uses;
+        if (!entry.brush.valid()) {
+            entry.brush = built.get_future().share();
+            building = true;
+        }
+        pending = entry.brush;
+    }
+    if (!building) {
+        // Waits outside the lock in case another eroder is still building it
+        return pending.get();
+    }
+
+    // Built outside the lock, so eroders only wait on builds of the brush they need
+    std::shared_ptr<const ErosionBrush> brush;
+    try {
+        brush = std::make_shared<const ErosionBrush>(map, radius, layout);
+    } catch (...) {
+        built.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(mutex);
+        brushes.erase(key);
+        throw;
+    }
+    built.set_value(brush);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto entry = brushes.find(key);
+    if (entry != brushes.end() && entry->second.bytes == 0) {
+        entry->second.bytes = brush->memoryUsage();
+        usedBytes += entry->second.bytes;
+        shrink();
+    }
+    return brush;
+}
+
+size_t BrushCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return brushes.size();
+}
+
+size_t BrushCache::memoryUsage() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return usedBytes;
+}
+
+void BrushCache::setCapacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacityBytes = bytes;
+    shrink();
+}
+
+size_t BrushCache::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return capacityBytes;
+}
+
+bool BrushCache::unused(const Entry& entry) {
+    // Brushes still being built have no bytes yet and are never evicted
+    return entry.bytes > 0 && entry.brush.get().use_count() == 1;
+}
+
+void BrushCache::shrink() {
+    while (usedBytes > capacityBytes) {
+        auto oldest = brushes.end();
+        for (auto entry = brushes.begin(); entry != brushes.end(); ++entry) {
+            if (unused(entry->second) && (oldest == brushes.end() || entry->second.lastUse < oldest->second.lastUse)) {
+                oldest = entry;
+            }
+        }
+        if (oldest == brushes.end()) {
+            return;
+        }
+        usedBytes -= oldest->second.bytes;
+        brushes.erase(oldest);
+    }
+}
+
+size_t BrushCache::evictUnused() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t evicted = 0;
+    for (auto entry = brushes.begin(); entry != brushes.end();) {
+        if (unused(entry->second)) {
+            usedBytes -= entry->second.bytes;
+            entry = brushes.erase(entry);
+            evicted++;
+        } else {
+            ++entry;
+        }
+    }
+    return evicted;
+}
+
+void BrushCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    brushes.clear();
+    usedBytes = 0;
+}
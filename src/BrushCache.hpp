@@ -0,0 +1,62 @@
+#ifndef BRUSHCACHE_HPP
+#define BRUSHCACHE_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include "ErosionBrush.hpp"
+#include "Heightmap.hpp"
+
+// Brushes shared by every eroder in the process, keyed by map shape, radius and layout.
+// A brush is built the first time it is asked for and handed out by reference count, so evicting it
+// only drops the cache's reference and eroders still using it keep it alive. Once the brushes take more
+// than the capacity, the least recently used ones no eroder holds are evicted
+class BrushCache {
+public:
+    // Cache used by Erosion
+    static BrushCache& shared();
+
+    // Eroders asking for a brush that is being built wait for that build, other brushes are built
+    // and handed out meanwhile
+    std::shared_ptr<const ErosionBrush> get(const HeightmapView& map, int radius, HeightmapLayout layout);
+
+    // Number of brushes and bytes held by the cache, including brushes only eroders still reference
+    size_t size() const;
+    size_t memoryUsage() const;
+
+    // Bytes of brushes kept around once no eroder holds them, 1 GiB by default. Lowering it evicts right away
+    void setCapacity(size_t bytes);
+    size_t capacity() const;
+
+    // Drops the brushes no eroder holds, returns how many went
+    size_t evictUnused();
+    void clear();
+
+private:
+    using Key = std::tuple<int, int, int, int, HeightmapLayout>;
+
+    struct Entry {
+        std::shared_future<std::shared_ptr<const ErosionBrush>> brush;
+        // 0 while it's being built
+        size_t bytes = 0;
+        uint64_t lastUse = 0;
+    };
+
+    mutable std::mutex mutex;
+    std::map<Key, Entry> brushes;
+    size_t capacityBytes = (size_t)1 << 30;
+    size_t usedBytes = 0;
+    uint64_t uses = 0;
+
+    static bool unused(const Entry& entry);
+    // Evicts least recently used brushes until they fit the capacity, mutex has to be held
+    void shrink();
+};
+
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef BRUSHSTENCIL_HPP
+#define BRUSHSTENCIL_HPP
+
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+// Square root usable in constant expressions. Newton's method in double, the float it
+// rounds to is the correctly rounded float root for the small integers brushes need
+constexpr double constexprSqrt(double x) {
+    double root = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        root = 0.5 * (root + x / root);
+    }
+    return x > 0 ? root : 0;
+}
+
+// Largest dx with (dx, dy) inside a brush of the radius
+constexpr int brushHalfWidth(int radius, int dy) {
+    int halfWidth = 0;
+    while ((halfWidth + 1) * (halfWidth + 1) + dy * dy < radius * radius) {
+        halfWidth++;
+    }
+    return halfWidth;
+}
+
+// Erosion brush of a radius known at compile time, as used for cells whose whole brush lies inside the map.
+// Every row of the brush is a contiguous run of cells. Points come in the same order and with the same
+// weights as the stencil of ErosionBrush
+template<int Radius>
+struct BrushStencil {
+    static constexpr int numRows = 2 * Radius - 1;
+    static constexpr int size = [] {
+        int points = 0;
+        for (int dy = 1 - Radius; dy < Radius; dy++) {
+            points += 2 * brushHalfWidth(Radius, dy) + 1;
+        }
+        return points;
+    }();
+
+    std::array<int, numRows> halfWidth = {};
+    // Index of the first point of every row
+    std::array<int, numRows> firstPoint = {};
+    std::array<float, size> weights = {};
+
+    constexpr BrushStencil() {
+        float weightSum = 0;
+        int point = 0;
+        for (int row = 0; row < numRows; row++) {
+            int dy = row - (Radius - 1);
+            halfWidth[row] = brushHalfWidth(Radius, dy);
+            firstPoint[row] = point;
+            for (int dx = -halfWidth[row]; dx <= halfWidth[row]; dx++) {
+                float sqrDst = dx * dx + dy * dy;
+                weights[point] = 1 - (float)constexprSqrt(sqrDst) / Radius;
+                weightSum += weights[point];
+                point++;
+            }
+        }
+        for (float& weight : weights) {
+            weight /= weightSum;
+        }
+    }
+};
+
+template<int Radius>
+inline constexpr BrushStencil<Radius> brushStencil = {};
+
+// Erodes the run of count cells starting at cells, every cell loses at most its height
+template<int Radius>
+inline void erodeStencilRun(float *cells, int count, int firstPoint, float amount, float *deltaSediment) {
+    for (int i = 0; i < count; i++) {
+        float weighedErodeAmount = amount * brushStencil<Radius>.weights[firstPoint + i];
+        float delta = (cells[i] < weighedErodeAmount) ? cells[i] : weighedErodeAmount;
+        cells[i] -= delta;
+        deltaSediment[firstPoint + i] = delta;
+    }
+}
+
+// Erodes one row of the brush around (x, y). Row-major rows are one run of a length known at compile time,
+// blocked rows are split where they cross into the next block
+template<int Radius, int Row, class Index>
+inline void erodeStencilRow(float *map, const Index &index, int x, int y, float amount, float *deltaSediment) {
+    constexpr int halfWidth = brushStencil<Radius>.halfWidth[Row];
+    constexpr int firstPoint = brushStencil<Radius>.firstPoint[Row];
+    int rowY = y + Row - (Radius - 1);
+    if constexpr (Index::rowMajor) {
+        erodeStencilRun<Radius>(map + index(x - halfWidth, rowY), 2 * halfWidth + 1, firstPoint, amount, deltaSediment);
+    } else {
+        for (int column = x - halfWidth; column <= x + halfWidth;) {
+            int run = std::min(Index::blockSize - (column & Index::blockMask), x + halfWidth + 1 - column);
+            erodeStencilRun<Radius>(map + index(column, rowY), run, firstPoint + column - (x - halfWidth), amount,
+                                    deltaSediment);
+            column += run;
+        }
+    }
+}
+
+template<int Radius, class Index, int... Rows>
+inline void erodeStencilRows(float *map, const Index &index, int x, int y, float amount, float *deltaSediment,
+                             std::integer_sequence<int, Rows...>) {
+    (erodeStencilRow<Radius, Rows>(map, index, x, y, amount, deltaSediment), ...);
+}
+
+// Erodes the whole brush around (x, y) with every row unrolled.
+// The sediment taken from point k is left in deltaSediment[k] so the caller can sum it up in order
+template<int Radius, class Index>
+inline void erodeStencil(float *map, const Index &index, int x, int y, float amount, float *deltaSediment) {
+    erodeStencilRows<Radius>(map, index, x, y, amount, deltaSediment,
+                             std::make_integer_sequence<int, BrushStencil<Radius>::numRows>());
+}
+
+
+#endif
@@ -0,0 +1,199 @@
+#include "Checkpoint.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+// File layout: magic, then every field of ErosionCheckpoint in declaration order in native byte order
+// (enums as int32), then mapSize * mapSize floats
+static const char checkpointMagic[8] = {'H', 'E', 'C', 'K', 'P', 'T', '0', '1'};
+
+template<class T>
+static void writeValue(std::ostream &out, const T &value) {
+    out.write((const char*)&value, sizeof(T));
+}
+
+// Flushes what was written to path, a file or a directory, to the disk
+static bool syncPath(const std::string &path, bool directory) {
+    int handle = open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_WRONLY);
+    if (handle < 0) {
+        return false;
+    }
+    bool synced = fsync(handle) == 0;
+    close(handle);
+    return synced;
+}
+
+template<class T>
+static void readValue(std::istream &in, T &value) {
+    in.read((char*)&value, sizeof(T));
+}
+
+void ErosionCheckpoint::capture(const Erosion &eroder) {
+    seed = eroder.seed;
+    erosionRadius = eroder.erosionRadius;
+    inertia = eroder.inertia;
+    sedimentCapacityFactor = eroder.sedimentCapacityFactor;
+    minSedimentCapacity = eroder.minSedimentCapacity;
+    erodeSpeed = eroder.erodeSpeed;
+    depositSpeed = eroder.depositSpeed;
+    evaporateSpeed = eroder.evaporateSpeed;
+    gravity = eroder.gravity;
+    maxDropletLifetime = eroder.maxDropletLifetime;
+    initialWaterVolume = eroder.initialWaterVolume;
+    initialSpeed = eroder.initialSpeed;
+    schedule = eroder.schedule;
+    kernel = eroder.resolveKernel();
+    parallelBatchSize = eroder.parallelBatchSize;
+    dropletCursor = eroder.dropletCursor;
+}
+
+bool ErosionCheckpoint::restore(Erosion &eroder) const {
+    eroder.seed = seed;
+    eroder.erosionRadius = erosionRadius;
+    eroder.inertia = inertia;
+    eroder.sedimentCapacityFactor = sedimentCapacityFactor;
+    eroder.minSedimentCapacity = minSedimentCapacity;
+    eroder.erodeSpeed = erodeSpeed;
+    eroder.depositSpeed = depositSpeed;
+    eroder.evaporateSpeed = evaporateSpeed;
+    eroder.gravity = gravity;
+    eroder.maxDropletLifetime = maxDropletLifetime;
+    eroder.initialWaterVolume = initialWaterVolume;
+    eroder.initialSpeed = initialSpeed;
+    eroder.schedule = schedule;
+    eroder.kernel = kernel;
+    eroder.parallelBatchSize = parallelBatchSize;
+    eroder.resumeAt(dropletCursor);
+    return eroder.resolveKernel() == kernel;
+}
+
+bool saveCheckpoint(const std::string &path, const ErosionCheckpoint &checkpoint) {
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+        out.write(checkpointMagic, sizeof(checkpointMagic));
+        writeValue(out, checkpoint.seed);
+        writeValue(out, checkpoint.erosionRadius);
+        writeValue(out, checkpoint.inertia);
+        writeValue(out, checkpoint.sedimentCapacityFactor);
+        writeValue(out, checkpoint.minSedimentCapacity);
+        writeValue(out, checkpoint.erodeSpeed);
+        writeValue(out, checkpoint.depositSpeed);
+        writeValue(out, checkpoint.evaporateSpeed);
+        writeValue(out, checkpoint.gravity);
+        writeValue(out, checkpoint.maxDropletLifetime);
+        writeValue(out, checkpoint.initialWaterVolume);
+        writeValue(out, checkpoint.initialSpeed);
+        writeValue(out, (int32_t)checkpoint.schedule);
+        writeValue(out, (int32_t)checkpoint.kernel);
+        writeValue(out, checkpoint.parallelBatchSize);
+        writeValue(out, checkpoint.dropletCursor);
+        writeValue(out, checkpoint.totalDroplets);
+        writeValue(out, checkpoint.mapSize);
+        out.write((const char*)checkpoint.map.data(), checkpoint.map.size() * sizeof(float));
+        out.close();
+        if (!out) {
+            return false;
+        }
+    }
+    // Without the syncs a power loss could keep the rename but not the data, losing the previous checkpoint too
+    if (!syncPath(temporaryPath, false) || std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        return false;
+    }
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    return syncPath(directory.empty() ? "." : directory, true);
+}
+
+bool loadCheckpoint(const std::string &path, ErosionCheckpoint &checkpoint) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(checkpointMagic)] = {};
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, checkpointMagic, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    int32_t schedule;
+    int32_t kernel;
+    readValue(in, checkpoint.seed);
+    readValue(in, checkpoint.erosionRadius);
+    readValue(in, checkpoint.inertia);
+    readValue(in, checkpoint.sedimentCapacityFactor);
+    readValue(in, checkpoint.minSedimentCapacity);
+    readValue(in, checkpoint.erodeSpeed);
+    readValue(in, checkpoint.depositSpeed);
+    readValue(in, checkpoint.evaporateSpeed);
+    readValue(in, checkpoint.gravity);
+    readValue(in, checkpoint.maxDropletLifetime);
+    readValue(in, checkpoint.initialWaterVolume);
+    readValue(in, checkpoint.initialSpeed);
+    readValue(in, schedule);
+    readValue(in, kernel);
+    readValue(in, checkpoint.parallelBatchSize);
+    readValue(in, checkpoint.dropletCursor);
+    readValue(in, checkpoint.totalDroplets);
+    readValue(in, checkpoint.mapSize);
+    if (!in || checkpoint.mapSize <= 0 || checkpoint.parallelBatchSize <= 0 ||
+        schedule < 0 || schedule > (int32_t)DropletSchedule::Binned ||
+        kernel < 0 || kernel > (int32_t)ErosionKernel::Auto) {
+        return false;
+    }
+    checkpoint.schedule = (DropletSchedule)schedule;
+    checkpoint.kernel = (ErosionKernel)kernel;
+
+    checkpoint.map.resize((size_t)checkpoint.mapSize * checkpoint.mapSize);
+    in.read((char*)checkpoint.map.data(), checkpoint.map.size() * sizeof(float));
+    return (bool)in;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &path) : path(path) {
+    worker = std::thread(&CheckpointWriter::workerLoop, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+void CheckpointWriter::submit(ErosionCheckpoint &&checkpoint) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = std::move(checkpoint);
+    }
+    changed.notify_all();
+}
+
+bool CheckpointWriter::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return !pending && !saving; });
+    return !failed;
+}
+
+void CheckpointWriter::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        changed.wait(lock, [this] { return pending || stopping; });
+        // Whatever is still waiting gets saved before stopping
+        if (!pending) {
+            return;
+        }
+        ErosionCheckpoint checkpoint = std::move(*pending);
+        pending.reset();
+        saving = true;
+
+        lock.unlock();
+        bool saved = saveCheckpoint(path, checkpoint);
+        lock.lock();
+
+        saving = false;
+        failed = failed || !saved;
+        changed.notify_all();
+    }
+}
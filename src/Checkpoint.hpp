@@ -0,0 +1,80 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Erosion.hpp"
+
+// Everything needed to carry on an erosion run exactly where it stopped: the parameters that affect
+// the result, the droplet cursor (the whole random state, since spawns only depend on seed and index)
+// and the heightmap
+struct ErosionCheckpoint {
+    int seed = 0;
+    int erosionRadius = 0;
+    float inertia = 0;
+    float sedimentCapacityFactor = 0;
+    float minSedimentCapacity = 0;
+    float erodeSpeed = 0;
+    float depositSpeed = 0;
+    float evaporateSpeed = 0;
+    float gravity = 0;
+    float maxDropletLifetime = 0;
+    float initialWaterVolume = 0;
+    float initialSpeed = 0;
+    DropletSchedule schedule = DropletSchedule::Sequential;
+    ErosionKernel kernel = ErosionKernel::Scalar;
+    int parallelBatchSize = 0;
+
+    long long dropletCursor = 0;
+    // Droplets the whole run simulates, it is done once dropletCursor gets here
+    long long totalDroplets = 0;
+
+    int mapSize = 0;
+    std::vector<float> map;
+
+    // Takes the parameters and cursor from eroder. The schedule and kernel stored are the ones erode really runs
+    void capture(const Erosion &eroder);
+    // Sets eroder up to continue from the checkpoint. False if this CPU can't run the stored kernel, the eroder
+    // would fall back to a narrower one and not continue the same map
+    bool restore(Erosion &eroder) const;
+};
+
+// Binary checkpoint files. Saving writes a temporary file next to path and renames it over path,
+// so an interrupted save leaves the previous checkpoint intact
+bool saveCheckpoint(const std::string &path, const ErosionCheckpoint &checkpoint);
+bool loadCheckpoint(const std::string &path, ErosionCheckpoint &checkpoint);
+
+// Saves checkpoints on a background thread so the simulation only pays for copying the map.
+// If a save is still running when the next checkpoint arrives, the newest one waiting replaces older ones
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(const std::string &path);
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    void submit(ErosionCheckpoint &&checkpoint);
+    // Waits for the checkpoint waiting and any save in progress, false if any save failed
+    bool finish();
+
+private:
+    std::string path;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::optional<ErosionCheckpoint> pending;
+    bool saving = false;
+    bool stopping = false;
+    bool failed = false;
+
+    void workerLoop();
+};
+
+
+#endif
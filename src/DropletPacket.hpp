@@ -0,0 +1,52 @@
+#ifndef DROPLETPACKET_HPP
+#define DROPLETPACKET_HPP
+
+
+struct ErosionStats;
+
+// Everything a batched droplet kernel needs, as plain data.
+// The kernels are compiled with their own instruction set flags, so they only see this struct
+// and never the inline code of the rest of the program.
+struct PacketKernelArgs {
+    // Row-major map of mapWidth x mapHeight cells, rows mapStride floats apart
+    float* map;
+    int mapWidth;
+    int mapHeight;
+    int mapStride;
+
+    // ErosionBrush tables
+    int brushBand;
+    const int* stencilOffsets;
+    const float* stencilWeights;
+    int stencilSize;
+    const int* borderStart;
+    const int* borderIndices;
+    const float* borderWeights;
+
+    float inertia;
+    float sedimentCapacityFactor;
+    float minSedimentCapacity;
+    float erodeSpeed;
+    float depositSpeed;
+    float evaporateSpeed;
+    float gravity;
+    float maxDropletLifetime;
+    float initialWaterVolume;
+    float initialSpeed;
+
+    const float* spawnX;
+    const float* spawnY;
+    int count;
+
+    // Filled in when not null
+    ErosionStats* stats;
+};
+
+// Simulate args.count droplets in lockstep packets of 4, 8 or 16 lanes and return the steps taken.
+// Only call the ones the running CPU supports
+long long simulateDropletPacketsSse(const PacketKernelArgs& args);
+long long simulateDropletPacketsAvx2(const PacketKernelArgs& args);
+long long simulateDropletPacketsAvx512(const PacketKernelArgs& args);
+
+
+#endif
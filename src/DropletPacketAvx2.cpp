@@ -0,0 +1,48 @@
+// Built with -mavx2, only call after checking the CPU supports it
+#include <immintrin.h>
+#include "DropletPacketKernel.hpp"
+
+namespace {
+
+struct Avx2Lanes {
+    static constexpr int width = 8;
+    using Float = __m256;
+    using Int = __m256i;
+    using Mask = __m256;
+
+    static Float load(const float* p) { return _mm256_load_ps(p); }
+    static void store(float* p, Float v) { _mm256_store_ps(p, v); }
+    static Float set(float v) { return _mm256_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+    static Float abs(Float a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+
+    static Mask lt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Mask gt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static Mask ge(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static Mask eq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static Mask ne(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static Mask maskOr(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+    static Mask maskAnd(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+    static unsigned bits(Mask m) { return (unsigned)_mm256_movemask_ps(m); }
+    static Float select(Mask m, Float ifTrue, Float ifFalse) { return _mm256_blendv_ps(ifFalse, ifTrue, m); }
+
+    static Int truncate(Float a) { return _mm256_cvttps_epi32(a); }
+    static Float toFloat(Int a) { return _mm256_cvtepi32_ps(a); }
+    static Int setInt(int v) { return _mm256_set1_epi32(v); }
+    static Int addInt(Int a, Int b) { return _mm256_add_epi32(a, b); }
+    static Int mulInt(Int a, Int b) { return _mm256_mullo_epi32(a, b); }
+    static void storeInt(int* p, Int v) { _mm256_store_si256((__m256i*)p, v); }
+    static Float gather(const float* base, Int index) { return _mm256_i32gather_ps(base, index, 4); }
+};
+
+}
+
+long long simulateDropletPacketsAvx2(const PacketKernelArgs& args) {
+    return simulateDropletPackets<Avx2Lanes>(args);
+}
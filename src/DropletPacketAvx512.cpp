@@ -0,0 +1,48 @@
+// Built with -mavx512f, only call after checking the CPU supports it
+#include <immintrin.h>
+#include "DropletPacketKernel.hpp"
+
+namespace {
+
+struct Avx512Lanes {
+    static constexpr int width = 16;
+    using Float = __m512;
+    using Int = __m512i;
+    using Mask = __mmask16;
+
+    static Float load(const float* p) { return _mm512_load_ps(p); }
+    static void store(float* p, Float v) { _mm512_store_ps(p, v); }
+    static Float set(float v) { return _mm512_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm512_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm512_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm512_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm512_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm512_sqrt_ps(a); }
+    static Float abs(Float a) { return _mm512_abs_ps(a); }
+
+    static Mask lt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static Mask gt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static Mask ge(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+    static Mask eq(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+    static Mask ne(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+    static Mask maskOr(Mask a, Mask b) { return a | b; }
+    static Mask maskAnd(Mask a, Mask b) { return a & b; }
+    static unsigned bits(Mask m) { return m; }
+    static Float select(Mask m, Float ifTrue, Float ifFalse) { return _mm512_mask_blend_ps(m, ifFalse, ifTrue); }
+
+    static Int truncate(Float a) { return _mm512_cvttps_epi32(a); }
+    static Float toFloat(Int a) { return _mm512_cvtepi32_ps(a); }
+    static Int setInt(int v) { return _mm512_set1_epi32(v); }
+    static Int addInt(Int a, Int b) { return _mm512_add_epi32(a, b); }
+    static Int mulInt(Int a, Int b) { return _mm512_mullo_epi32(a, b); }
+    static void storeInt(int* p, Int v) { _mm512_store_si512(p, v); }
+    static Float gather(const float* base, Int index) { return _mm512_i32gather_ps(index, base, 4); }
+};
+
+}
+
+long long simulateDropletPacketsAvx512(const PacketKernelArgs& args) {
+    return simulateDropletPackets<Avx512Lanes>(args);
+}
@@ -0,0 +1,281 @@
+// Lockstep droplet kernel shared by the DropletPacket*.cpp files.
+// Every includer instantiates it with its own lane type, so it lives in an anonymous namespace
+// and gets compiled separately for each instruction set.
+//
+// A lane type V provides:
+//   width, Float, Int, Mask
+//   load, store, set, add, sub, mul, div, min, max, sqrt, abs
+//   lt, gt, ge, eq, ne, maskOr, maskAnd, bits, select
+//   truncate, toFloat, setInt, addInt, mulInt, storeInt, gather
+
+#include "DropletPacket.hpp"
+#include "ErosionStats.hpp"
+
+namespace {
+
+template<class V>
+long long simulateDropletPackets(const PacketKernelArgs& args) {
+    using Float = typename V::Float;
+    using Int = typename V::Int;
+    using Mask = typename V::Mask;
+    constexpr int width = V::width;
+    constexpr unsigned allLanes = (1u << width) - 1;
+
+    if (args.count <= 0 || args.maxDropletLifetime <= 0) {
+        return 0;
+    }
+
+    float* map = args.map;
+    int mapWidth = args.mapWidth;
+    int mapHeight = args.mapHeight;
+    int mapStride = args.mapStride;
+    ErosionStats* stats = args.stats;
+
+    // Droplet state, one lane per droplet
+    alignas(64) float posX[width];
+    alignas(64) float posY[width];
+    alignas(64) float dirX[width];
+    alignas(64) float dirY[width];
+    alignas(64) float speed[width];
+    alignas(64) float water[width];
+    alignas(64) float sediment[width];
+    alignas(64) float lifetime[width];
+
+    // Per step results handed from the vector part to the scalar writes
+    alignas(64) int nodeIndex[width];
+    alignas(64) int nodeX[width];
+    alignas(64) int nodeY[width];
+    alignas(64) float cellOffsetX[width];
+    alignas(64) float cellOffsetY[width];
+    alignas(64) float amountToDeposit[width];
+    alignas(64) float amountToErode[width];
+
+    unsigned activeLanes = 0;
+    int nextDroplet = 0;
+    long long steps = 0;
+
+    auto spawn = [&](int lane) {
+        if (nextDroplet < args.count) {
+            posX[lane] = args.spawnX[nextDroplet];
+            posY[lane] = args.spawnY[nextDroplet];
+            speed[lane] = args.initialSpeed;
+            water[lane] = args.initialWaterVolume;
+            activeLanes |= 1u << lane;
+            nextDroplet++;
+        } else {
+            // Idle lanes sit on the first cell so their gathers stay inside the map
+            posX[lane] = 0;
+            posY[lane] = 0;
+            speed[lane] = 0;
+            water[lane] = 0;
+        }
+        dirX[lane] = 0;
+        dirY[lane] = 0;
+        sediment[lane] = 0;
+        lifetime[lane] = 0;
+    };
+
+    for (int lane = 0; lane < width; lane++) {
+        spawn(lane);
+    }
+
+    const Float zero = V::set(0);
+    const Float one = V::set(1);
+    const Float inertia = V::set(args.inertia);
+    const Float flowWeight = V::set(1 - args.inertia);
+    const Float mapLimitX = V::set((float)(mapWidth - 1));
+    const Float mapLimitY = V::set((float)(mapHeight - 1));
+    const Float capacityFactor = V::set(args.sedimentCapacityFactor);
+    const Float minCapacity = V::set(args.minSedimentCapacity);
+    const Float erodeSpeed = V::set(args.erodeSpeed);
+    const Float depositSpeed = V::set(args.depositSpeed);
+    const Float evaporation = V::set(1 - args.evaporateSpeed);
+    const Float gravity = V::set(args.gravity);
+    const Float maxLifetime = V::set(args.maxDropletLifetime);
+    const Int rowStride = V::setInt(mapStride);
+    const Int eastOffset = V::setInt(1);
+    const Int southOffset = V::setInt(mapStride);
+    const Int southEastOffset = V::setInt(mapStride + 1);
+
+    while (activeLanes) {
+        Float px = V::load(posX);
+        Float py = V::load(posY);
+
+        // Height and gradient at the current position
+        Int cellX = V::truncate(px);
+        Int cellY = V::truncate(py);
+        Float x = V::sub(px, V::toFloat(cellX));
+        Float y = V::sub(py, V::toFloat(cellY));
+        Int index = V::addInt(V::mulInt(cellY, rowStride), cellX);
+
+        Float heightNW = V::gather(map, index);
+        Float heightNE = V::gather(map, V::addInt(index, eastOffset));
+        Float heightSW = V::gather(map, V::addInt(index, southOffset));
+        Float heightSE = V::gather(map, V::addInt(index, southEastOffset));
+
+        Float invX = V::sub(one, x);
+        Float invY = V::sub(one, y);
+        Float gradientX = V::add(V::mul(V::sub(heightNE, heightNW), invY), V::mul(V::sub(heightSE, heightSW), y));
+        Float gradientY = V::add(V::mul(V::sub(heightSW, heightNW), invX), V::mul(V::sub(heightSE, heightNE), x));
+        Float height = V::add(V::add(V::mul(V::mul(heightNW, invX), invY), V::mul(V::mul(heightNE, x), invY)),
+                              V::add(V::mul(V::mul(heightSW, invX), y), V::mul(V::mul(heightSE, x), y)));
+
+        // Update the direction and move one unit
+        Float dx = V::sub(V::mul(V::load(dirX), inertia), V::mul(gradientX, flowWeight));
+        Float dy = V::sub(V::mul(V::load(dirY), inertia), V::mul(gradientY, flowWeight));
+        Float len = V::sqrt(V::add(V::mul(dx, dx), V::mul(dy, dy)));
+        Mask hasLength = V::ne(len, zero);
+        dx = V::select(hasLength, V::div(dx, len), dx);
+        dy = V::select(hasLength, V::div(dy, len), dy);
+        Float newX = V::add(px, dx);
+        Float newY = V::add(py, dy);
+
+        Mask zeroDirection = V::maskAnd(V::eq(dx, zero), V::eq(dy, zero));
+        Mask stopped = V::maskOr(zeroDirection, V::maskOr(V::maskOr(V::lt(newX, zero), V::ge(newX, mapLimitX)),
+                                                          V::maskOr(V::lt(newY, zero), V::ge(newY, mapLimitY))));
+        unsigned movingLanes = activeLanes & ~V::bits(stopped);
+        steps += __builtin_popcount(movingLanes);
+
+        // Height at the new position, stopped lanes sample the first cell instead of leaving the map
+        Float sampleX = V::select(stopped, zero, newX);
+        Float sampleY = V::select(stopped, zero, newY);
+        Int newCellX = V::truncate(sampleX);
+        Int newCellY = V::truncate(sampleY);
+        Float nx = V::sub(sampleX, V::toFloat(newCellX));
+        Float ny = V::sub(sampleY, V::toFloat(newCellY));
+        Int newIndex = V::addInt(V::mulInt(newCellY, rowStride), newCellX);
+        Float newNW = V::gather(map, newIndex);
+        Float newNE = V::gather(map, V::addInt(newIndex, eastOffset));
+        Float newSW = V::gather(map, V::addInt(newIndex, southOffset));
+        Float newSE = V::gather(map, V::addInt(newIndex, southEastOffset));
+        Float invNX = V::sub(one, nx);
+        Float invNY = V::sub(one, ny);
+        Float newHeight = V::add(V::add(V::mul(V::mul(newNW, invNX), invNY), V::mul(V::mul(newNE, nx), invNY)),
+                                 V::add(V::mul(V::mul(newSW, invNX), ny), V::mul(V::mul(newSE, nx), ny)));
+
+        Float deltaHeight = V::sub(newHeight, height);
+        Float speedNow = V::load(speed);
+        Float waterNow = V::load(water);
+        Float sedimentNow = V::load(sediment);
+        Float capacity = V::max(V::mul(V::mul(V::mul(V::sub(zero, deltaHeight), speedNow), waterNow), capacityFactor), minCapacity);
+
+        Mask uphill = V::gt(deltaHeight, zero);
+        unsigned depositingLanes = V::bits(V::maskOr(V::gt(sedimentNow, capacity), uphill));
+        V::store(amountToDeposit, V::select(uphill, V::min(deltaHeight, sedimentNow),
+                                            V::mul(V::sub(sedimentNow, capacity), depositSpeed)));
+        V::store(amountToErode, V::min(V::mul(V::sub(capacity, sedimentNow), erodeSpeed), V::sub(zero, deltaHeight)));
+        V::storeInt(nodeIndex, index);
+        V::storeInt(nodeX, cellX);
+        V::storeInt(nodeY, cellY);
+        V::store(cellOffsetX, x);
+        V::store(cellOffsetY, y);
+
+        if (stats) {
+            stats->depositSteps += __builtin_popcount(movingLanes & depositingLanes);
+            stats->erodeSteps += __builtin_popcount(movingLanes & ~depositingLanes);
+        }
+
+        // Heightmap writes go lane by lane in a fixed order so the result is deterministic
+        for (unsigned lanes = movingLanes; lanes; lanes &= lanes - 1) {
+            int lane = __builtin_ctz(lanes);
+            int dropletIndex = nodeIndex[lane];
+            if (depositingLanes & (1u << lane)) {
+                float amount = amountToDeposit[lane];
+                float offX = cellOffsetX[lane];
+                float offY = cellOffsetY[lane];
+                sediment[lane] -= amount;
+                if (stats) {
+                    stats->sedimentDeposited += amount;
+                }
+                map[dropletIndex] += amount * (1 - offX) * (1 - offY);
+                map[dropletIndex + 1] += amount * offX * (1 - offY);
+                map[dropletIndex + mapStride] += amount * (1 - offX) * offY;
+                map[dropletIndex + mapStride + 1] += amount * offX * offY;
+            } else {
+                // Same lookup as ErosionBrush::at
+                int centerX = nodeX[lane];
+                int centerY = nodeY[lane];
+                int band = args.brushBand;
+                const int* offsets;
+                const float* weights;
+                int numPoints;
+                int base;
+                if (centerX >= band && centerX < mapWidth - band && centerY >= band && centerY < mapHeight - band) {
+                    offsets = args.stencilOffsets;
+                    weights = args.stencilWeights;
+                    numPoints = args.stencilSize;
+                    base = dropletIndex;
+                } else {
+                    int sideRows = mapHeight - 2 * band;
+                    int row;
+                    if (centerY < band) {
+                        row = centerY * mapWidth + centerX;
+                    } else if (centerY >= mapHeight - band) {
+                        row = band * mapWidth + sideRows * 2 * band + (centerY - (mapHeight - band)) * mapWidth + centerX;
+                    } else {
+                        row = band * mapWidth + (centerY - band) * 2 * band +
+                              (centerX < band ? centerX : centerX - (mapWidth - 2 * band));
+                    }
+                    offsets = args.borderIndices + args.borderStart[row];
+                    weights = args.borderWeights + args.borderStart[row];
+                    numPoints = args.borderStart[row + 1] - args.borderStart[row];
+                    base = 0;
+                }
+
+                float amount = amountToErode[lane];
+                float collected = sediment[lane];
+                for (int k = 0; k < numPoints; k++) {
+                    int node = base + offsets[k];
+                    float weighedErodeAmount = amount * weights[k];
+                    float deltaSediment = (map[node] < weighedErodeAmount) ? map[node] : weighedErodeAmount;
+                    map[node] -= deltaSediment;
+                    collected += deltaSediment;
+                }
+                if (stats) {
+                    stats->sedimentEroded += collected - sediment[lane];
+                }
+                sediment[lane] = collected;
+            }
+        }
+
+        V::store(speed, V::sqrt(V::add(V::mul(speedNow, speedNow), V::mul(V::abs(deltaHeight), gravity))));
+        V::store(water, V::mul(waterNow, evaporation));
+        Float age = V::add(V::load(lifetime), one);
+        V::store(lifetime, age);
+        V::store(posX, newX);
+        V::store(posY, newY);
+        V::store(dirX, dx);
+        V::store(dirY, dy);
+
+        // Retire droplets that stopped or ran out of lifetime and refill their lanes
+        unsigned retired = (activeLanes & ~movingLanes) | (movingLanes & V::bits(V::ge(age, maxLifetime)));
+        unsigned idle = allLanes & ~activeLanes;
+        if (stats) {
+            unsigned zeroDirectionLanes = V::bits(zeroDirection);
+            for (unsigned lanes = retired; lanes; lanes &= lanes - 1) {
+                int lane = __builtin_ctz(lanes);
+                // A stopped droplet didn't get to take this step
+                int dropletSteps = (int)lifetime[lane];
+                if (movingLanes & (1u << lane)) {
+                    stats->expiredDroplets++;
+                } else {
+                    dropletSteps--;
+                    if (zeroDirectionLanes & (1u << lane)) {
+                        stats->zeroDirectionExits++;
+                    } else {
+                        stats->offMapExits++;
+                    }
+                }
+                stats->recordLifetime(dropletSteps);
+                stats->droplets++;
+            }
+        }
+        activeLanes &= ~retired;
+        for (unsigned lanes = retired | idle; lanes; lanes &= lanes - 1) {
+            spawn(__builtin_ctz(lanes));
+        }
+    }
+    return steps;
+}
+
+}
@@ -0,0 +1,54 @@
+// Built with -msse4.1, only call after checking the CPU supports it
+#include <smmintrin.h>
+#include "DropletPacketKernel.hpp"
+
+namespace {
+
+struct SseLanes {
+    static constexpr int width = 4;
+    using Float = __m128;
+    using Int = __m128i;
+    using Mask = __m128;
+
+    static Float load(const float* p) { return _mm_load_ps(p); }
+    static void store(float* p, Float v) { _mm_store_ps(p, v); }
+    static Float set(float v) { return _mm_set1_ps(v); }
+    static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+    static Float abs(Float a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+
+    static Mask lt(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+    static Mask gt(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+    static Mask ge(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+    static Mask eq(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+    static Mask ne(Float a, Float b) { return _mm_cmpneq_ps(a, b); }
+    static Mask maskOr(Mask a, Mask b) { return _mm_or_ps(a, b); }
+    static Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+    static unsigned bits(Mask m) { return (unsigned)_mm_movemask_ps(m); }
+    static Float select(Mask m, Float ifTrue, Float ifFalse) { return _mm_blendv_ps(ifFalse, ifTrue, m); }
+
+    static Int truncate(Float a) { return _mm_cvttps_epi32(a); }
+    static Float toFloat(Int a) { return _mm_cvtepi32_ps(a); }
+    static Int setInt(int v) { return _mm_set1_epi32(v); }
+    static Int addInt(Int a, Int b) { return _mm_add_epi32(a, b); }
+    static Int mulInt(Int a, Int b) { return _mm_mullo_epi32(a, b); }
+    static void storeInt(int* p, Int v) { _mm_store_si128((__m128i*)p, v); }
+
+    // No gather instruction before AVX2
+    static Float gather(const float* base, Int index) {
+        alignas(16) int lanes[4];
+        _mm_store_si128((__m128i*)lanes, index);
+        return _mm_setr_ps(base[lanes[0]], base[lanes[1]], base[lanes[2]], base[lanes[3]]);
+    }
+};
+
+}
+
+long long simulateDropletPacketsSse(const PacketKernelArgs& args) {
+    return simulateDropletPackets<SseLanes>(args);
+}
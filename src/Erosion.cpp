@@ -1,109 +1,730 @@
 #include "Erosion.hpp"
+#include "BrushCache.hpp"
+#include "BrushStencil.hpp"
+#include "DropletPacket.hpp"
+#include "Philox.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <fenv.h>
 
-void Erosion::initialize(int mapSize, bool resetSeed) {
+const char* erosionKernelName(ErosionKernel kernel) {
+    switch (kernel) {
+        case ErosionKernel::Sse: return "sse";
+        case ErosionKernel::Avx2: return "avx2";
+        case ErosionKernel::Avx512: return "avx512";
+        case ErosionKernel::Auto: return "auto";
+        default: return "scalar";
+    }
+}
+
+bool parseErosionKernel(const std::string& name, ErosionKernel& kernel) {
+    for (ErosionKernel candidate : {ErosionKernel::Scalar, ErosionKernel::Sse, ErosionKernel::Avx2,
+                                    ErosionKernel::Avx512, ErosionKernel::Auto}) {
+        if (name == erosionKernelName(candidate)) {
+            kernel = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Erosion::initialize(const HeightmapView &map, bool resetSeed) {
     //feenableexcept(FE_INVALID | FE_OVERFLOW);
     if (resetSeed || !hasSeed || currentSeed != seed) {
-        Random::seed(seed);
+        dropletCursor = 0;
         hasSeed = true;
         currentSeed = seed;
     }
 
-    if (erosionBrushIndices.size() != 0 || currentErosionRadius != erosionRadius || currentMapSize != mapSize) {
-        initializeBrushIndices(mapSize, erosionRadius);
-        currentErosionRadius = erosionRadius;
-        currentMapSize = mapSize;
+    if (!brush || brush->radius != erosionRadius || !brush->fits(map) || brush->layout != activeLayout) {
+        brush = BrushCache::shared().get(map, erosionRadius, activeLayout);
     }
 }
 
+void Erosion::resumeAt(long long cursor) {
+    hasSeed = true;
+    currentSeed = seed;
+    dropletCursor = cursor;
+}
+
 void Erosion::erode(std::vector<float> *map, int mapSize, int numIterations, bool resetSeed) {
-    initialize(mapSize, resetSeed);
+    activeLayout = HeightmapLayout::RowMajor;
+    erodeMap({map->data(), mapSize, mapSize, mapSize}, {0, 0, (float)(mapSize - 1), (float)(mapSize - 1)},
+             numIterations, resetSeed);
+}
+
+bool Erosion::erode(const HeightmapView &map, int numIterations, bool resetSeed) {
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width) {
+        return false;
+    }
+    activeLayout = HeightmapLayout::RowMajor;
+    erodeMap(map, {0, 0, (float)(map.width - 1), (float)(map.height - 1)}, numIterations, resetSeed);
+    return true;
+}
+
+bool Erosion::erode(std::span<float> map, int width, int height, int stride, int numIterations, bool resetSeed) {
+    // The last row only needs its width, so tightly cropped sub-rectangles of a bigger map fit
+    if (width < 2 || height < 2 || stride < width || map.size() < (size_t)(height - 1) * stride + width) {
+        return false;
+    }
+    return erode(HeightmapView{map.data(), width, height, stride}, numIterations, resetSeed);
+}
+
+bool Erosion::erodeRegion(const HeightmapView &map, const MapRect &region, int numIterations, bool resetSeed,
+                          MapRect *changed) {
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width) {
+        return false;
+    }
+    // Droplets spawn on cells that have a neighbor to the east and south
+    int spawnMinX = std::max(region.x, 0);
+    int spawnMinY = std::max(region.y, 0);
+    int spawnMaxX = std::min(region.x + region.width, map.width - 1);
+    int spawnMaxY = std::min(region.y + region.height, map.height - 1);
+    if (region.width <= 0 || region.height <= 0 || spawnMinX >= spawnMaxX || spawnMinY >= spawnMaxY) {
+        return false;
+    }
+
+    // Nothing outside the spawn area grown by the reach of a droplet can change
+    int reach = dropletReach();
+    MapRect window;
+    window.x = std::max(spawnMinX - reach, 0);
+    window.y = std::max(spawnMinY - reach, 0);
+    window.width = std::min(spawnMaxX + reach, map.width) - window.x;
+    window.height = std::min(spawnMaxY + reach, map.height) - window.y;
+    if (changed) {
+        regionSnapshot.resize((size_t)window.width * window.height);
+        for (int row = 0; row < window.height; row++) {
+            std::copy_n(map.data + (size_t)(window.y + row) * map.stride + window.x, window.width,
+                        regionSnapshot.data() + (size_t)row * window.width);
+        }
+    }
+
+    activeLayout = HeightmapLayout::RowMajor;
+    SpawnArea area = {(float)spawnMinX, (float)spawnMinY, (float)spawnMaxX, (float)spawnMaxY};
+    erodeMap(map, area, numIterations, resetSeed);
+
+    if (changed) {
+        int minX = window.width;
+        int minY = window.height;
+        int maxX = -1;
+        int maxY = -1;
+        for (int row = 0; row < window.height; row++) {
+            const float* before = regionSnapshot.data() + (size_t)row * window.width;
+            const float* after = map.data + (size_t)(window.y + row) * map.stride + window.x;
+            if (std::equal(before, before + window.width, after)) {
+                continue;
+            }
+            minY = std::min(minY, row);
+            maxY = row;
+            for (int column = 0; column < window.width; column++) {
+                if (before[column] != after[column]) {
+                    minX = std::min(minX, column);
+                    maxX = std::max(maxX, column);
+                }
+            }
+        }
+        *changed = maxY < 0 ? MapRect{window.x, window.y, 0, 0}
+                            : MapRect{window.x + minX, window.y + minY, maxX - minX + 1, maxY - minY + 1};
+    }
+    return true;
+}
+
+void Erosion::erode(Heightmap *map, int numIterations, bool resetSeed) {
+    activeLayout = map->layout();
+    erodeMap(map->view(), {0, 0, (float)(map->size() - 1), (float)(map->size() - 1)}, numIterations, resetSeed);
+}
+
+ConvergenceReport Erosion::erodeUntilConverged(Heightmap *map, const ConvergenceLimits &limits, bool resetSeed) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    long long cells = (long long)map->size() * map->size();
+    long long batchSize = limits.batchSize > 0 ? limits.batchSize : cells;
+    // Batches end where the run can be split, which a resumed cursor may be in between of
+    long long alignment = splitAlignment();
+
+    // The change is read from the stats, which the kernels fill without an extra pass over the map
+    bool keepStats = collectStats;
+    collectStats = true;
+    ErosionStats totalStats = {};
+    ConvergenceReport report;
+    int previousCount = 0;
+    int quietBatches = 0;
+    while (report.droplets < limits.maxIterations) {
+        // What erode would do to the cursor, the batch end is worked out from it
+        if ((resetSeed && report.batches == 0) || !hasSeed || currentSeed != seed) {
+            resumeAt(0);
+        }
+        long long end = (dropletCursor + batchSize + alignment - 1) / alignment * alignment;
+        int count = (int)std::min(end - dropletCursor, limits.maxIterations - report.droplets);
+        erode(map, count);
+        totalStats.merge(stats);
+
+        double change = (stats.sedimentEroded + stats.sedimentDeposited) / count;
+        if (report.batches == 0) {
+            report.firstChange = change;
+        } else {
+            // Relative to the larger of the two, so a change dropping to nothing counts as one whole change
+            double larger = std::max(change, report.lastChange);
+            double difference = larger > 0 ? std::abs(change - report.lastChange) / larger : 0;
+            report.lastDifference = difference * cells / (0.5 * (previousCount + count));
+            quietBatches = report.lastDifference < limits.threshold ? quietBatches + 1 : 0;
+        }
+        report.lastChange = change;
+        previousCount = count;
+        report.droplets += count;
+        report.batches++;
+        if (quietBatches >= 2 || change < limits.minChange) {
+            report.converged = true;
+            break;
+        }
+        if (limits.timeBudgetSeconds > 0 &&
+            std::chrono::duration<double>(Clock::now() - start).count() >= limits.timeBudgetSeconds) {
+            report.outOfTime = true;
+            break;
+        }
+    }
+    collectStats = keepStats;
+    stats = keepStats ? totalStats : ErosionStats{};
+    return report;
+}
 
+bool Erosion::erodeRows(const HeightmapView &map, int firstRow, int endRow, const std::vector<DropletState> &arriving,
+                        std::vector<DropletState> &leaving, int numIterations, bool resetSeed) {
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width || firstRow < 0 ||
+        endRow > map.height || firstRow > endRow) {
+        return false;
+    }
+    ErosionStats* activeStats = collectStats ? &stats : nullptr;
+    if (activeStats) {
+        stats.reset();
+    }
+    activeLayout = HeightmapLayout::RowMajor;
+    initialize(map, resetSeed);
+    simulatedSteps = 0;
+
+    BandFunction flow = collectStats ? bandFunctionFor<true>(erosionRadius) : bandFunctionFor<false>(erosionRadius);
+    auto carryOn = [&](DropletState droplet) {
+        int startLifetime = droplet.lifetime;
+        if ((this->*flow)(map, droplet, firstRow, endRow, activeStats)) {
+            leaving.push_back(droplet);
+        }
+        simulatedSteps += droplet.lifetime - startLifetime;
+    };
+    for (const DropletState &droplet : arriving) {
+        carryOn(droplet);
+    }
+    SpawnArea area = {0, 0, (float)(map.width - 1), (float)(map.height - 1)};
     for (int iteration = 0; iteration < numIterations; iteration++) {
-        // Creates the droplet at a random X and Y on the map
-        float posX = Random::get<float>(0, mapSize - 1);
-        float posY = Random::get<float>(0, mapSize - 1);
-        float dirX = 0;
-        float dirY = 0;
-        float speed = initialSpeed;
-        float water = initialWaterVolume;
-        float sediment = 0;
-
-        // Simulates the droplet only up to it's max lifetime, prevents an infite loop
-        for (int lifetime = 0; lifetime < maxDropletLifetime; lifetime++) {
-            int nodeX = (int)posX;
-            int nodeY = (int)posY;
-            int dropletIndex = nodeY * mapSize + nodeX;
-            // Calculates the droplet offset inside the cell
-            float cellOffsetX = posX - nodeX;
-            float cellOffsetY = posY - nodeY;
-
-            // Calculate droplet's height and direction of flow with bilinear interpolation of surrounding heights
-            HeightAndGradient* heightAndGradient = calculateHeightAndGradient(map, mapSize, posX, posY);
-            // Update the droplet's direction and position (move position 1 unit regardless of speed)
-            dirX = (dirX * inertia - heightAndGradient->gradientX * (1 - inertia));
-            dirY = (dirY * inertia - heightAndGradient->gradientY * (1 - inertia));
-            // Normalize direction
-            float len = std::sqrt(dirX * dirX + dirY * dirY);
-            if (len != 0) {
-                dirX /= len;
-                dirY /= len;
+        float posX;
+        float posY;
+        spawnPosition(dropletCursor + iteration, area, posX, posY);
+        if ((int)posY >= firstRow && (int)posY < endRow) {
+            carryOn({posX, posY, 0, 0, initialSpeed, initialWaterVolume, 0, 0});
+        }
+    }
+    dropletCursor += numIterations;
+    return true;
+}
+
+int Erosion::dropletReach() const {
+    // A droplet moves at most one cell per step, so everything it reads or writes lies within
+    // its lifetime plus the brush radius and the bilinear footprint of where it spawned
+    return (int)std::ceil(maxDropletLifetime) + erosionRadius + 2;
+}
+
+void Erosion::erodeMap(const HeightmapView &map, const SpawnArea &area, int numIterations, bool resetSeed) {
+    using Clock = std::chrono::steady_clock;
+    ErosionStats* activeStats = collectStats ? &stats : nullptr;
+    if (activeStats) {
+        stats.reset();
+    }
+
+    Clock::time_point setupStart = Clock::now();
+    initialize(map, resetSeed);
+    Clock::time_point simulationStart = Clock::now();
+    simulatedSteps = 0;
+
+    // The packet kernels gather from row-major maps only
+    ErosionKernel activeKernel = activeLayout == HeightmapLayout::RowMajor ? resolveKernel() : ErosionKernel::Scalar;
+    erodeArea(map, area, dropletCursor, numIterations, activeKernel, activeStats);
+    dropletCursor += numIterations;
+
+    if (activeStats) {
+        stats.brushSeconds = std::chrono::duration<double>(simulationStart - setupStart).count();
+        stats.simulationSeconds = std::chrono::duration<double>(Clock::now() - simulationStart).count();
+    }
+}
+
+void Erosion::erode(TiledHeightmap *map, int numIterations, bool resetSeed) {
+    using Clock = std::chrono::steady_clock;
+    ErosionStats* activeStats = collectStats ? &stats : nullptr;
+    if (activeStats) {
+        stats.reset();
+    }
+
+    // Each tile is eroded inside a window that adds everything its droplets can reach on all sides.
+    // Windows are pushed back inside the map at the edges, so a window edge is either the map edge
+    // or at least a full halo away from the tile
+    int mapSize = map->size();
+    int tileSize = map->tileSize();
+    int halo = dropletReach();
+    int windowSize = std::min(mapSize, tileSize + 2 * halo);
+
+    activeLayout = HeightmapLayout::RowMajor;
+    Clock::time_point setupStart = Clock::now();
+    std::vector<float> window((size_t)windowSize * windowSize);
+    HeightmapView windowView = {window.data(), windowSize, windowSize, windowSize};
+    initialize(windowView, resetSeed);
+    Clock::time_point simulationStart = Clock::now();
+    simulatedSteps = 0;
+
+    ErosionKernel activeKernel = resolveKernel();
+    int tilesPerSide = map->tilesPerSide();
+
+    // Droplets are shared out in proportion to the spawn area of each tile
+    double spawnExtent = mapSize - 1;
+    long long assigned = 0;
+    for (int tileY = 0; tileY < tilesPerSide; tileY++) {
+        for (int tileX = 0; tileX < tilesPerSide; tileX++) {
+            double minX = tileX * tileSize;
+            double minY = tileY * tileSize;
+            double maxX = std::min(minX + tileSize, spawnExtent);
+            double maxY = std::min(minY + tileSize, spawnExtent);
+            // Area of all tiles so far, whole numbers so the last tile covers exactly everything
+            double coveredArea = minY * spawnExtent + (maxY - minY) * maxX;
+            long long assignedAfter = (long long)(numIterations * (coveredArea / (spawnExtent * spawnExtent)));
+            int count = (int)(assignedAfter - assigned);
+            if (count <= 0) {
+                continue;
             }
-            posX += dirX;
-            posY += dirY;
 
-            // Stop simulating droplet if it's not moving or has flowed over edge of map
-            if ((dirX == 0 && dirY == 0) || posX < 0 || posX >= mapSize - 1 || posY < 0 || posY >= mapSize - 1) {
-                break;
+            int windowX = std::clamp(tileX * tileSize - halo, 0, mapSize - windowSize);
+            int windowY = std::clamp(tileY * tileSize - halo, 0, mapSize - windowSize);
+            map->read(windowX, windowY, windowSize, windowSize, window.data(), windowSize);
+
+            SpawnArea tileArea = {(float)(minX - windowX), (float)(minY - windowY),
+                                  (float)(maxX - windowX), (float)(maxY - windowY)};
+            erodeArea(windowView, tileArea, dropletCursor + assigned, count, activeKernel, activeStats);
+
+            map->write(windowX, windowY, windowSize, windowSize, window.data(), windowSize);
+            map->release();
+            assigned = assignedAfter;
+        }
+    }
+    dropletCursor += numIterations;
+
+    if (activeStats) {
+        stats.brushSeconds = std::chrono::duration<double>(simulationStart - setupStart).count();
+        stats.simulationSeconds = std::chrono::duration<double>(Clock::now() - simulationStart).count();
+    }
+}
+
+void Erosion::erodeArea(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                        ErosionKernel activeKernel, ErosionStats *activeStats) {
+    if (schedule == DropletSchedule::Tiled) {
+        erodeParallel(map, area, firstDroplet, numIterations, activeKernel, activeStats);
+    } else if (schedule == DropletSchedule::Binned) {
+        erodeBinned(map, area, firstDroplet, numIterations, activeKernel, activeStats);
+    } else {
+        erodeSerial(map, area, firstDroplet, numIterations, activeKernel, activeStats);
+    }
+}
+
+void Erosion::spawnPosition(long long droplet, const SpawnArea &area, float &posX, float &posY) const {
+    std::array<uint32_t, 4> bits = Philox4x32::generate(droplet, (uint32_t)seed);
+    // Keeps rounding from landing a droplet on the far edge, the last row or column has no cell to its east or south
+    posX = std::min(area.minX + Philox4x32::toUnitFloat(bits[0]) * (area.maxX - area.minX),
+                    std::nextafter(area.maxX, area.minX));
+    posY = std::min(area.minY + Philox4x32::toUnitFloat(bits[1]) * (area.maxY - area.minY),
+                    std::nextafter(area.maxY, area.minY));
+}
+
+void Erosion::erodeSerial(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                          ErosionKernel activeKernel, ErosionStats *activeStats) {
+    if (activeKernel == ErosionKernel::Scalar) {
+        DropletFunction simulate = dropletFunction(activeStats);
+        for (int iteration = 0; iteration < numIterations; iteration++) {
+            // Creates the droplet at a random X and Y on the map
+            float posX;
+            float posY;
+            spawnPosition(firstDroplet + iteration, area, posX, posY);
+            simulatedSteps += (this->*simulate)(map, posX, posY, activeStats);
+        }
+        return;
+    }
+
+    // Packet kernels take their droplets from a spawn list, filled in chunks to keep it small.
+    // Chunks start at multiples of the chunk size so splitting a run over several erode calls doesn't change it
+    const int chunkSize = packetChunkSize;
+    std::vector<float> spawnX(std::min(chunkSize, numIterations));
+    std::vector<float> spawnY(spawnX.size());
+    long long lastDroplet = firstDroplet + numIterations;
+    for (long long chunkStart = firstDroplet; chunkStart < lastDroplet;) {
+        long long chunkEnd = std::min(lastDroplet, (chunkStart / chunkSize + 1) * chunkSize);
+        int count = (int)(chunkEnd - chunkStart);
+        for (int i = 0; i < count; i++) {
+            spawnPosition(chunkStart + i, area, spawnX[i], spawnY[i]);
+        }
+        chunkStart = chunkEnd;
+        simulatedSteps += simulateDroplets(activeKernel, map, spawnX.data(), spawnY.data(), count, activeStats);
+    }
+}
+
+long long Erosion::splitAlignment() const {
+    if (schedule != DropletSchedule::Sequential) {
+        return parallelBatchSize;
+    }
+    return resolveKernel() == ErosionKernel::Scalar ? 1 : packetChunkSize;
+}
+
+ErosionKernel Erosion::resolveKernel() const {
+    ErosionKernel requested = (kernel == ErosionKernel::Auto) ? ErosionKernel::Avx512 : kernel;
+#if defined(HYDRAULIC_EROSION_X86)
+    __builtin_cpu_init();
+    if (requested == ErosionKernel::Avx512 && __builtin_cpu_supports("avx512f")) {
+        return ErosionKernel::Avx512;
+    }
+    if (requested >= ErosionKernel::Avx2 && __builtin_cpu_supports("avx2")) {
+        return ErosionKernel::Avx2;
+    }
+    if (requested >= ErosionKernel::Sse && __builtin_cpu_supports("sse4.1")) {
+        return ErosionKernel::Sse;
+    }
+#endif
+    return ErosionKernel::Scalar;
+}
+
+long long Erosion::simulateDroplets(ErosionKernel activeKernel, const HeightmapView &map,
+                                    const float *spawnX, const float *spawnY, int count, ErosionStats *activeStats) {
+#if defined(HYDRAULIC_EROSION_X86)
+    if (activeKernel != ErosionKernel::Scalar) {
+        PacketKernelArgs args = brush->packetArgs();
+        args.map = map.data;
+        args.inertia = inertia;
+        args.sedimentCapacityFactor = sedimentCapacityFactor;
+        args.minSedimentCapacity = minSedimentCapacity;
+        args.erodeSpeed = erodeSpeed;
+        args.depositSpeed = depositSpeed;
+        args.evaporateSpeed = evaporateSpeed;
+        args.gravity = gravity;
+        args.maxDropletLifetime = maxDropletLifetime;
+        args.initialWaterVolume = initialWaterVolume;
+        args.initialSpeed = initialSpeed;
+        args.spawnX = spawnX;
+        args.spawnY = spawnY;
+        args.count = count;
+        args.stats = activeStats;
+
+        switch (activeKernel) {
+            case ErosionKernel::Avx512:
+                return simulateDropletPacketsAvx512(args);
+            case ErosionKernel::Avx2:
+                return simulateDropletPacketsAvx2(args);
+            default:
+                return simulateDropletPacketsSse(args);
+        }
+    }
+#endif
+    DropletFunction simulate = dropletFunction(activeStats);
+    long long steps = 0;
+    for (int i = 0; i < count; i++) {
+        steps += (this->*simulate)(map, spawnX[i], spawnY[i], activeStats);
+    }
+    return steps;
+}
+
+void Erosion::erodeParallel(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                            ErosionKernel activeKernel, ErosionStats *activeStats) {
+    if (!threadPool || threadPool->size() != numThreads) {
+        threadPool = std::make_unique<ThreadPool>(numThreads);
+    }
+
+    int reach = dropletReach();
+    // Tiles of the same color are a whole tile apart, so with tiles twice the reach
+    // droplets spawned in different tiles of one color can never touch the same cell
+    int tileSize = 2 * reach;
+    int tilesX = (map.width + tileSize - 1) / tileSize;
+    int tilesY = (map.height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+
+    // Checkerboard of four colors, every phase runs all tiles of one color at the same time
+    std::vector<int> phaseTiles[4];
+    for (int tile = 0; tile < numTiles; tile++) {
+        int tileX = tile % tilesX;
+        int tileY = tile / tilesX;
+        phaseTiles[(tileX & 1) | ((tileY & 1) << 1)].push_back(tile);
+    }
+
+    SpawnBins bins;
+    std::vector<long long> tileSteps(numTiles);
+    // Every tile counts into its own stats, merged once its phase is done
+    std::vector<ErosionStats> tileStats(activeStats ? numTiles : 0);
+
+    long long lastDroplet = firstDroplet + numIterations;
+    for (long long batchStart = firstDroplet; batchStart < lastDroplet;) {
+        long long batchEnd = std::min(lastDroplet, (batchStart / parallelBatchSize + 1) * parallelBatchSize);
+        binSpawns(area, batchStart, (int)(batchEnd - batchStart), tileSize, tilesX, numTiles, bins);
+        const std::vector<int>& tileStart = bins.binStart;
+
+        for (const std::vector<int>& tiles : phaseTiles) {
+            threadPool->parallelFor((int)tiles.size(), [&](int i) {
+                int tile = tiles[i];
+                ErosionStats* statsOfTile = activeStats ? &tileStats[tile] : nullptr;
+                if (statsOfTile) {
+                    statsOfTile->reset();
+                }
+                tileSteps[tile] = simulateDroplets(activeKernel, map, &bins.sortedX[tileStart[tile]],
+                                                   &bins.sortedY[tileStart[tile]],
+                                                   tileStart[tile + 1] - tileStart[tile], statsOfTile);
+            });
+            for (int tile : tiles) {
+                simulatedSteps += tileSteps[tile];
+                if (activeStats) {
+                    activeStats->merge(tileStats[tile]);
+                }
             }
+        }
+        batchStart = batchEnd;
+    }
+}
+
+void Erosion::erodeBinned(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                          ErosionKernel activeKernel, ErosionStats *activeStats) {
+    // The cells a bin's droplets can reach, the bin grown by dropletReach on every side, stay around
+    // a few hundred KiB with the default lifetime and fit in L2
+    const int binSize = 128;
+    int binsX = (map.width + binSize - 1) / binSize;
+    int binsY = (map.height + binSize - 1) / binSize;
+    int numBins = binsX * binsY;
+
+    SpawnBins bins;
+    long long lastDroplet = firstDroplet + numIterations;
+    for (long long batchStart = firstDroplet; batchStart < lastDroplet;) {
+        long long batchEnd = std::min(lastDroplet, (batchStart / parallelBatchSize + 1) * parallelBatchSize);
+        binSpawns(area, batchStart, (int)(batchEnd - batchStart), binSize, binsX, numBins, bins);
+        for (int bin = 0; bin < numBins; bin++) {
+            int start = bins.binStart[bin];
+            simulatedSteps += simulateDroplets(activeKernel, map, &bins.sortedX[start], &bins.sortedY[start],
+                                               bins.binStart[bin + 1] - start, activeStats);
+        }
+        batchStart = batchEnd;
+    }
+}
+
+void Erosion::binSpawns(const SpawnArea &area, long long batchStart, int batchSize, int binSize, int binsX,
+                        int numBins, SpawnBins &bins) const {
+    if ((int)bins.spawnX.size() < batchSize) {
+        bins.spawnX.resize(batchSize);
+        bins.spawnY.resize(batchSize);
+        bins.spawnBin.resize(batchSize);
+        bins.sortedX.resize(batchSize);
+        bins.sortedY.resize(batchSize);
+    }
+    bins.binStart.assign(numBins + 1, 0);
+    for (int i = 0; i < batchSize; i++) {
+        spawnPosition(batchStart + i, area, bins.spawnX[i], bins.spawnY[i]);
+        bins.spawnBin[i] = ((int)bins.spawnY[i] / binSize) * binsX + (int)bins.spawnX[i] / binSize;
+        bins.binStart[bins.spawnBin[i] + 1]++;
+    }
 
-            // Find the droplet's new height and calculate the deltaHeight
-            auto newHeightYes = calculateHeightAndGradient(map, mapSize, posX, posY);
-            float newHeight = newHeightYes->height;
-            float deltaHeight = newHeight - heightAndGradient->height;
-
-            // Calculate the droplet's sediment capacity (higher when moving fast down a slope and contains lots of water)
-            float sedimentCapacity = std::max(-deltaHeight * speed * water * sedimentCapacityFactor, minSedimentCapacity);
-
-            // If carrying more sediment than capacity, or if flowing uphill:
-            if (sediment > sedimentCapacity || deltaHeight > 0) {
-                // If moving uphill (deltaHeight > 0) try fill up to the current height, otherwise deposit a fraction of the excess sediment
-                float amountToDeposit = (deltaHeight > 0) ? std::min (deltaHeight, sediment) : (sediment - sedimentCapacity) * depositSpeed;
-                sediment -= amountToDeposit;
-
-                // Add the sediment to the four nodes of the current cell using bilinear interpolation
-                // Deposition is not distributed over a radius (like erosion) so that it can fill small pits
-                map->at(dropletIndex) += amountToDeposit * (1 - cellOffsetX) * (1 - cellOffsetY);
-                map->at(dropletIndex + 1) += amountToDeposit * cellOffsetX * (1 - cellOffsetY);
-                map->at(dropletIndex + mapSize) += amountToDeposit * (1 - cellOffsetX) * cellOffsetY;
-                map->at(dropletIndex + mapSize + 1) += amountToDeposit * cellOffsetX * cellOffsetY;
-            } else {
-                // Erode a fraction of the droplet's current carry capacity.
-                // Clamp the erosion to the change in height so that it doesn't dig a hole in the terrain behind the droplet
-                float amountToErode = std::min((sedimentCapacity - sediment) * erodeSpeed, -deltaHeight);
-
-                // Use erosion brush to erode from all nodes inside the droplet's erosion radius
-                for (int brushPointIndex = 0; brushPointIndex < erosionBrushIndices[dropletIndex]->size(); brushPointIndex++) {
-                    int nodeIndex = erosionBrushIndices[dropletIndex]->at(brushPointIndex);
-                    float weighedErodeAmount = amountToErode * erosionBrushWeights[dropletIndex]->at(brushPointIndex);
-                    float deltaSediment = (map->at(nodeIndex) < weighedErodeAmount) ? map->at(nodeIndex) : weighedErodeAmount;
-                    map->at(nodeIndex) -= deltaSediment;
-                    sediment += deltaSediment;
+    // Counting sort the droplets by bin, keeping spawn order inside every bin
+    for (int bin = 0; bin < numBins; bin++) {
+        bins.binStart[bin + 1] += bins.binStart[bin];
+    }
+    std::vector<int> binFill(bins.binStart.begin(), bins.binStart.end() - 1);
+    for (int i = 0; i < batchSize; i++) {
+        int slot = binFill[bins.spawnBin[i]]++;
+        bins.sortedX[slot] = bins.spawnX[i];
+        bins.sortedY[slot] = bins.spawnY[i];
+    }
+}
+
+template<bool CollectStats, class Index>
+Erosion::DropletFunction Erosion::dropletFunctionFor(int radius) {
+    switch (radius) {
+        case 1: return &Erosion::simulateDroplet<CollectStats, 1, Index>;
+        case 2: return &Erosion::simulateDroplet<CollectStats, 2, Index>;
+        case 3: return &Erosion::simulateDroplet<CollectStats, 3, Index>;
+        case 4: return &Erosion::simulateDroplet<CollectStats, 4, Index>;
+        case 5: return &Erosion::simulateDroplet<CollectStats, 5, Index>;
+        case 6: return &Erosion::simulateDroplet<CollectStats, 6, Index>;
+        case 7: return &Erosion::simulateDroplet<CollectStats, 7, Index>;
+        case 8: return &Erosion::simulateDroplet<CollectStats, 8, Index>;
+        default: return &Erosion::simulateDroplet<CollectStats, 0, Index>;
+    }
+}
+
+template<bool CollectStats>
+Erosion::BandFunction Erosion::bandFunctionFor(int radius) {
+    switch (radius) {
+        case 1: return &Erosion::flowDroplet<CollectStats, 1, RowMajorIndex, true>;
+        case 2: return &Erosion::flowDroplet<CollectStats, 2, RowMajorIndex, true>;
+        case 3: return &Erosion::flowDroplet<CollectStats, 3, RowMajorIndex, true>;
+        case 4: return &Erosion::flowDroplet<CollectStats, 4, RowMajorIndex, true>;
+        case 5: return &Erosion::flowDroplet<CollectStats, 5, RowMajorIndex, true>;
+        case 6: return &Erosion::flowDroplet<CollectStats, 6, RowMajorIndex, true>;
+        case 7: return &Erosion::flowDroplet<CollectStats, 7, RowMajorIndex, true>;
+        case 8: return &Erosion::flowDroplet<CollectStats, 8, RowMajorIndex, true>;
+        default: return &Erosion::flowDroplet<CollectStats, 0, RowMajorIndex, true>;
+    }
+}
+
+Erosion::DropletFunction Erosion::dropletFunction(bool collectStats) const {
+    if (activeLayout == HeightmapLayout::Blocked) {
+        return collectStats ? dropletFunctionFor<true, BlockedIndex>(erosionRadius)
+                            : dropletFunctionFor<false, BlockedIndex>(erosionRadius);
+    }
+    return collectStats ? dropletFunctionFor<true, RowMajorIndex>(erosionRadius)
+                        : dropletFunctionFor<false, RowMajorIndex>(erosionRadius);
+}
+
+template<bool CollectStats, int Radius, class Index>
+int Erosion::simulateDroplet(const HeightmapView &view, float posX, float posY, ErosionStats *activeStats) {
+    DropletState droplet = {posX, posY, 0, 0, initialSpeed, initialWaterVolume, 0, 0};
+    flowDroplet<CollectStats, Radius, Index, false>(view, droplet, 0, 0, activeStats);
+    return droplet.lifetime;
+}
+
+template<bool CollectStats, int Radius, class Index, bool Bounded>
+bool Erosion::flowDroplet(const HeightmapView &view, DropletState &droplet, int firstRow, int endRow,
+                          ErosionStats *activeStats) {
+    float posX = droplet.posX;
+    float posY = droplet.posY;
+    float dirX = droplet.dirX;
+    float dirY = droplet.dirY;
+    float speed = droplet.speed;
+    float water = droplet.water;
+    float sediment = droplet.sediment;
+    int steps = droplet.lifetime;
+    float *map = view.data;
+    Index index(view);
+
+    // Simulates the droplet only up to it's max lifetime, prevents an infite loop
+    for (int lifetime = steps; lifetime < maxDropletLifetime; lifetime++) {
+        int nodeX = (int)posX;
+        int nodeY = (int)posY;
+        if constexpr (Bounded) {
+            // Flowed out of the band, the eroder owning its new row carries on from here
+            if (nodeY < firstRow || nodeY >= endRow) {
+                droplet = {posX, posY, dirX, dirY, speed, water, sediment, steps};
+                return true;
+            }
+        }
+        // Calculates the droplet offset inside the cell
+        float cellOffsetX = posX - nodeX;
+        float cellOffsetY = posY - nodeY;
+
+        // Calculate droplet's height and direction of flow with bilinear interpolation of surrounding heights
+        HeightAndGradient heightAndGradient = sampleHeightAndGradient(map, index, posX, posY);
+        // Update the droplet's direction and position (move position 1 unit regardless of speed)
+        dirX = (dirX * inertia - heightAndGradient.gradientX * (1 - inertia));
+        dirY = (dirY * inertia - heightAndGradient.gradientY * (1 - inertia));
+        // Normalize direction
+        float len = std::sqrt(dirX * dirX + dirY * dirY);
+        if (len != 0) {
+            dirX /= len;
+            dirY /= len;
+        }
+        posX += dirX;
+        posY += dirY;
+
+        // Stop simulating droplet if it's not moving or has flowed over edge of map
+        if ((dirX == 0 && dirY == 0) || posX < 0 || posX >= view.width - 1 || posY < 0 || posY >= view.height - 1) {
+            if constexpr (CollectStats) {
+                if (dirX == 0 && dirY == 0) {
+                    activeStats->zeroDirectionExits++;
+                } else {
+                    activeStats->offMapExits++;
                 }
+                activeStats->recordLifetime(steps);
+                activeStats->droplets++;
+            }
+            droplet.lifetime = steps;
+            return false;
+        }
+        steps++;
+
+        // Find the droplet's new height and calculate the deltaHeight
+        float newHeight = sampleHeightAndGradient(map, index, posX, posY).height;
+        float deltaHeight = newHeight - heightAndGradient.height;
+
+        // Calculate the droplet's sediment capacity (higher when moving fast down a slope and contains lots of water)
+        float sedimentCapacity = std::max(-deltaHeight * speed * water * sedimentCapacityFactor, minSedimentCapacity);
+
+        // If carrying more sediment than capacity, or if flowing uphill:
+        if (sediment > sedimentCapacity || deltaHeight > 0) {
+            // If moving uphill (deltaHeight > 0) try fill up to the current height, otherwise deposit a fraction of the excess sediment
+            float amountToDeposit = (deltaHeight > 0) ? std::min (deltaHeight, sediment) : (sediment - sedimentCapacity) * depositSpeed;
+            sediment -= amountToDeposit;
+            if constexpr (CollectStats) {
+                activeStats->depositSteps++;
+                activeStats->sedimentDeposited += amountToDeposit;
             }
 
-            speed = std::sqrt(speed * speed + std::abs(deltaHeight) * gravity);
-            water *= (1 - evaporateSpeed);
+            // Add the sediment to the four nodes of the current cell using bilinear interpolation
+            // Deposition is not distributed over a radius (like erosion) so that it can fill small pits
+            map[index(nodeX, nodeY)] += amountToDeposit * (1 - cellOffsetX) * (1 - cellOffsetY);
+            map[index(nodeX + 1, nodeY)] += amountToDeposit * cellOffsetX * (1 - cellOffsetY);
+            map[index(nodeX, nodeY + 1)] += amountToDeposit * (1 - cellOffsetX) * cellOffsetY;
+            map[index(nodeX + 1, nodeY + 1)] += amountToDeposit * cellOffsetX * cellOffsetY;
+        } else {
+            // Erode a fraction of the droplet's current carry capacity.
+            // Clamp the erosion to the change in height so that it doesn't dig a hole in the terrain behind the droplet
+            float amountToErode = std::min((sedimentCapacity - sediment) * erodeSpeed, -deltaHeight);
 
-            delete heightAndGradient;
-            delete newHeightYes;
+            // Use erosion brush to erode from all nodes inside the droplet's erosion radius
+            bool erodedWithStencil = false;
+            if constexpr (Radius > 0) {
+                if (brush->isInterior(nodeX, nodeY)) {
+                    float deltaSediment[BrushStencil<Radius>::size];
+                    erodeStencil<Radius>(map, index, nodeX, nodeY, amountToErode, deltaSediment);
+                    for (float delta : deltaSediment) {
+                        sediment += delta;
+                        if constexpr (CollectStats) {
+                            activeStats->sedimentEroded += delta;
+                        }
+                    }
+                    erodedWithStencil = true;
+                }
+            }
+            BrushSpan brushPoints = erodedWithStencil ? BrushSpan{} : brush->at(nodeX, nodeY);
+            // Only row-major interior cells have constant offsets, other layouts place every stencil point
+            bool placePoints = !Index::rowMajor && brush->isInterior(nodeX, nodeY);
+            for (int brushPointIndex = 0; brushPointIndex < brushPoints.size; brushPointIndex++) {
+                int nodeIndex = placePoints ? index(nodeX + brush->stencilX()[brushPointIndex],
+                                                    nodeY + brush->stencilY()[brushPointIndex])
+                                            : brushPoints.base + brushPoints.offsets[brushPointIndex];
+                float weighedErodeAmount = amountToErode * brushPoints.weights[brushPointIndex];
+                float deltaSediment = (map[nodeIndex] < weighedErodeAmount) ? map[nodeIndex] : weighedErodeAmount;
+                map[nodeIndex] -= deltaSediment;
+                sediment += deltaSediment;
+                if constexpr (CollectStats) {
+                    activeStats->sedimentEroded += deltaSediment;
+                }
+            }
+            if constexpr (CollectStats) {
+                activeStats->erodeSteps++;
+            }
         }
+
+        speed = std::sqrt(speed * speed + std::abs(deltaHeight) * gravity);
+        water *= (1 - evaporateSpeed);
+    }
+
+    if constexpr (CollectStats) {
+        activeStats->expiredDroplets++;
+        activeStats->recordLifetime(steps);
+        activeStats->droplets++;
     }
+    droplet.lifetime = steps;
+    return false;
 }
 
-HeightAndGradient* Erosion::calculateHeightAndGradient(std::vector<float> *nodes, int mapSize, float posX, float posY) {
+template<class Index>
+HeightAndGradient Erosion::sampleHeightAndGradient(const float *nodes, const Index &index, float posX, float posY) const {
     int coordX = (int)posX;
     int coordY = (int)posY;
 
@@ -112,11 +733,10 @@ HeightAndGradient* Erosion::calculateHeightAndGradient(std::vector<float> *nodes
     float y = posY - coordY;
 
     // Calculate heights of the nodes
-    int nodeIndexNW = coordY * mapSize + coordX;
-    float heightNW = nodes->at(nodeIndexNW);
-    float heightNE = nodes->at(nodeIndexNW + 1);
-    float heightSW = nodes->at(nodeIndexNW + mapSize);
-    float heightSE = nodes->at(nodeIndexNW + mapSize + 1);
+    float heightNW = nodes[index(coordX, coordY)];
+    float heightNE = nodes[index(coordX + 1, coordY)];
+    float heightSW = nodes[index(coordX, coordY + 1)];
+    float heightSE = nodes[index(coordX + 1, coordY + 1)];
 
     // Calculate droplet's direction of flow with bilinear interpolation of height difference along the edges
     float gradientX = (heightNE - heightNW) * (1 - y) + (heightSE - heightSW) * y;
@@ -125,58 +745,13 @@ HeightAndGradient* Erosion::calculateHeightAndGradient(std::vector<float> *nodes
     // Calculate height with bilinear interpolation of the heights of the nodes of the cell
     float height = heightNW * (1 - x) * (1 - y) + heightNE * x * (1 - y) + heightSW * (1 - x) * y + heightSE * x * y;
 
-    HeightAndGradient* yes = new HeightAndGradient();
-    yes->height = height;
-    yes->gradientX = gradientX;
-    yes->gradientY = gradientY;
-
-    return yes;
-}
-
-void Erosion::initializeBrushIndices(int mapSize, int radius) {
-    erosionBrushIndices.reserve(mapSize * mapSize);
-    erosionBrushWeights.reserve(mapSize * mapSize);
-
-    std::vector<int> xOffsets(radius * radius * 4);
-    std::vector<int> yOffsets(radius * radius * 4);
-    std::vector<float> weights(radius * radius * 4);
-    float weightSum = 0;
-    int addIndex = 0;
-
-    for (int i = 0; i < (mapSize * mapSize) - 1; i++) {
-        int centerX = i % mapSize;
-        int centerY = i / mapSize;
-
-        if (centerY <= radius || centerY >= mapSize - radius || centerX <= radius + 1 || centerX >= mapSize - radius) {
-            weightSum = 0;
-            addIndex = 0;
-            for (int y = -radius; y <= radius; y++) {
-                for (int x = -radius; x <= radius; x++) {
-                    float sqrDst = x * x + y * y;
-                    if (sqrDst < radius * radius) {
-                        int coordX = centerX + x;
-                        int coordY = centerY + y;
-
-                        if (coordX >= 0 && coordX < mapSize && coordY >= 0 && coordY < mapSize) {
-                            float weight = 1 - std::sqrt(sqrDst) / radius;
-                            weightSum += weight;
-                            weights[addIndex] = weight;
-                            xOffsets[addIndex] = x;
-                            yOffsets[addIndex] = y;
-                            addIndex++;
-                        }
-                    }
-                }
-            }
-        }
+    return HeightAndGradient{height, gradientX, gradientY};
+}
 
-        int numEntries = addIndex;
-        erosionBrushIndices.push_back(new std::vector<int>(numEntries));
-        erosionBrushWeights.push_back(new std::vector<float>(numEntries));
+HeightAndGradient Erosion::calculateHeightAndGradient(const float *nodes, int mapSize, float posX, float posY) const {
+    return sampleHeightAndGradient(nodes, RowMajorIndex(mapSize), posX, posY);
+}
 
-        for (int j = 0; j < numEntries; j++) {
-            erosionBrushIndices[i]->push_back((yOffsets[j] + centerY) * mapSize + xOffsets[j] + centerX);
-            erosionBrushWeights[i]->push_back(weights[j] / weightSum);
-        }
-    }
+HeightAndGradient Erosion::calculateHeightAndGradient(const HeightmapView &map, float posX, float posY) const {
+    return sampleHeightAndGradient(map.data, RowMajorIndex(map), posX, posY);
 }
@@ -2,10 +2,15 @@
 #define EROSION_HPP
 
 
+#include <memory>
+#include <span>
+#include <string>
 #include <vector>
-#include <effolkronium/random.hpp>
-
-using Random = effolkronium::random_static;
+#include "ErosionBrush.hpp"
+#include "ErosionStats.hpp"
+#include "Heightmap.hpp"
+#include "ThreadPool.hpp"
+#include "TiledHeightmap.hpp"
 
 struct HeightAndGradient {
     float height;
@@ -13,6 +18,94 @@ struct HeightAndGradient {
     float gradientY;
 };
 
+// Droplet kernel used by erode. The SIMD kernels advance a packet of droplets in lockstep,
+// so droplets in one packet interleave their heightmap updates step by step
+enum class ErosionKernel {
+    Scalar,
+    Sse,
+    Avx2,
+    Avx512,
+    // Widest kernel the running CPU supports
+    Auto
+};
+
+// Rectangle droplets spawn in, from (minX, minY) up to but not including (maxX, maxY)
+struct SpawnArea {
+    float minX;
+    float minY;
+    float maxX;
+    float maxY;
+};
+
+// Rectangle of cells from (x, y) up to but not including (x + width, y + height)
+struct MapRect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Droplet between two steps, what erodeRows hands on when the droplet flows out of its rows
+struct DropletState {
+    float posX;
+    float posY;
+    float dirX;
+    float dirY;
+    float speed;
+    float water;
+    float sediment;
+    // Steps taken so far
+    int lifetime;
+};
+
+// Order in which the droplets of an erode call are simulated. Sequential and Binned always run on one thread,
+// only Tiled uses numThreads
+enum class DropletSchedule {
+    // One droplet after another in spawn order, on a single thread
+    Sequential,
+    // Droplets binned into checkerboard tiles that run in four phases. The result only depends
+    // on the seed, the droplet range and parallelBatchSize, not on numThreads, and differs from
+    // the sequential one. Changing parallelBatchSize changes the map
+    Tiled,
+    // Sequential, but each batch of parallelBatchSize droplets is binned into squares of the map by spawn position
+    // and run a square at a time, so consecutive droplets reuse the cells and brush rows still in cache. The
+    // droplets spawn where they would on the other schedules, only their order changes
+    Binned
+};
+
+// When erodeUntilConverged stops
+struct ConvergenceLimits {
+    // Most droplets to simulate
+    long long maxIterations = 1 << 30;
+    // Droplets between checks, 0 for one per map cell. Batches end at the next multiple of splitAlignment,
+    // so where the run stops doesn't change what the droplets before it did
+    int batchSize = 0;
+    // Converged once the change per droplet differs by less than this fraction between two batches, twice in a row.
+    // The change is the sediment eroded plus deposited, which the droplet kernels sum as they go. The difference is
+    // scaled to batches of one droplet per map cell, so it doesn't depend on how long the batches are
+    double threshold = 0.01;
+    // A batch changing the map by less than this per droplet counts as settled whatever came before it
+    double minChange = 1e-5;
+    // No batch starts after this much wall time, 0 for no limit
+    double timeBudgetSeconds = 0;
+};
+
+struct ConvergenceReport {
+    long long droplets = 0;
+    int batches = 0;
+    // Change per droplet of the first and the last batch
+    double firstChange = 0;
+    double lastChange = 0;
+    // How much the change per droplet differed between the last two batches, scaled as for the threshold
+    double lastDifference = 0;
+    bool converged = false;
+    bool outOfTime = false;
+};
+
+// Names used on the command line: scalar, sse, avx2, avx512 and auto
+const char* erosionKernelName(ErosionKernel kernel);
+bool parseErosionKernel(const std::string& name, ErosionKernel& kernel);
+
 class Erosion {
 public:
     int seed;
@@ -30,21 +123,134 @@ public:
     float initialSpeed = 1;
 
     bool hasSeed = false;
+    // Droplet i spawns at a position derived only from (seed, i). erode simulates the droplets from here on
+    // and advances it, resetting the seed or changing it starts over at 0
+    long long dropletCursor = 0;
+
+    DropletSchedule schedule = DropletSchedule::Sequential;
+    // Threads simulating droplets on the tiled schedule, the others ignore it
+    int numThreads = 1;
+    // Droplets binned together by the tiled and binned schedules, batches start at multiples of this droplet index
+    int parallelBatchSize = 1 << 20;
+    // Requested kernels the CPU can't run fall back to the next narrower one
+    ErosionKernel kernel = ErosionKernel::Scalar;
+
+    // Droplet steps that eroded or deposited during the last erode call
+    long long simulatedSteps = 0;
+
+    // Fill stats during erode. When off the scalar kernel has the counters compiled out
+    // and the packet kernels skip them with one branch per step
+    bool collectStats = false;
+    // Statistics of the last erode call
+    ErosionStats stats = {};
 
     void erode(std::vector<float> *map, int mapSize, int numIterations = 1, bool resetSeed = false);
+    // Erodes caller-owned row-major memory in place, without copying it. Maps don't have to be square,
+    // the stride is the distance between rows in floats. False if the map is smaller than 2 x 2 cells,
+    // the stride is less than the width or the span can't hold every row
+    bool erode(const HeightmapView &map, int numIterations = 1, bool resetSeed = false);
+    bool erode(std::span<float> map, int width, int height, int stride, int numIterations = 1, bool resetSeed = false);
+    // Erodes only around region of a row-major map, for re-running erosion after a local edit. Droplets spawn
+    // inside region and can change cells up to their reach around it. The brush is kept between calls on maps
+    // of the same shape. If changed isn't null it receives the bounding rectangle of the cells that changed,
+    // empty if none did. False if the map is invalid or region doesn't overlap the cells droplets can spawn on
+    bool erodeRegion(const HeightmapView &map, const MapRect &region, int numIterations = 1, bool resetSeed = false,
+                     MapRect *changed = nullptr);
+    // Same result as eroding the row-major map. Blocked maps always run the scalar kernel
+    void erode(Heightmap *map, int numIterations = 1, bool resetSeed = false);
+    // Erodes in batches until the map has settled, the time budget is used up or maxIterations droplets ran.
+    // The droplets that ran give the same map as one erode call with that many. With collectStats, stats
+    // cover every batch
+    ConvergenceReport erodeUntilConverged(Heightmap *map, const ConvergenceLimits &limits, bool resetSeed = false);
+    // Erodes a map that doesn't have to fit in memory, one tile of the store at a time. Only a window of
+    // the tile plus the reach of its droplets (maxDropletLifetime, erosionRadius and the bilinear footprint)
+    // is resident at once. Droplets spawn in the tile they are assigned to, in proportion to its area
+    void erode(TiledHeightmap *map, int numIterations = 1, bool resetSeed = false);
+    // Erodes the band of rows [firstRow, endRow) of a row-major map for a shard that owns it (see erodeSharded).
+    // Carries on the arriving droplets first, then the next numIterations droplets of the seed that spawn in the
+    // band, skipping the others. Droplets read and write up to erosionRadius + 1 rows outside the band, and the
+    // ones flowing out of it are appended to leaving to be carried on by the shard owning their new row.
+    // Always runs the scalar kernel. False if the map is invalid or the band isn't inside it
+    bool erodeRows(const HeightmapView &map, int firstRow, int endRow, const std::vector<DropletState> &arriving,
+                   std::vector<DropletState> &leaving, int numIterations = 1, bool resetSeed = false);
+    // Makes the next erode call, without resetSeed, carry on from droplet cursor of the current seed.
+    // Used to resume a run from a checkpoint
+    void resumeAt(long long cursor);
+    HeightAndGradient calculateHeightAndGradient(const float *nodes, int mapSize, float posX, float posY) const;
+    HeightAndGradient calculateHeightAndGradient(const HeightmapView &map, float posX, float posY) const;
+    // Kernel erode will actually run on this CPU
+    ErosionKernel resolveKernel() const;
+    // Runs can be split into erode calls ending on multiples of this droplet index without changing the result.
+    // On the sequential schedule 1 for the scalar kernel and packetChunkSize for the others, parallelBatchSize
+    // on the tiled and binned ones
+    long long splitAlignment() const;
+
+    // Droplets the sequential schedule hands the packet kernels at a time, chunks start at multiples of it
+    static constexpr int packetChunkSize = 4096;
 
 private:
-    std::vector<std::vector<int> *> erosionBrushIndices = std::vector<std::vector<int> *>();
-    std::vector<std::vector<float> *> erosionBrushWeights = std::vector<std::vector<float> *>();
+    // Shared with every other eroder on maps of the same shape, see BrushCache
+    std::shared_ptr<const ErosionBrush> brush;
 
     int currentSeed;
-    int currentErosionRadius;
-    int currentMapSize;
 
-    void initialize(int mapSize, bool resetSeed);
-    HeightAndGradient* calculateHeightAndGradient(std::vector<float> *nodes, int mapSize,
-                                                 float posX, float posY);
-    void initializeBrushIndices(int mapSize, int radius);
+    std::unique_ptr<ThreadPool> threadPool;
+
+    // Cells around the region of the last erodeRegion call from before it ran, kept to find what changed
+    std::vector<float> regionSnapshot;
+
+    // Layout of the map being eroded, the brush and the scalar kernels index cells with it
+    HeightmapLayout activeLayout = HeightmapLayout::RowMajor;
+
+    void initialize(const HeightmapView &map, bool resetSeed);
+    void erodeMap(const HeightmapView &map, const SpawnArea &area, int numIterations, bool resetSeed);
+    // Distance from its spawn position within which a droplet reads or writes cells
+    int dropletReach() const;
+    template<class Index>
+    HeightAndGradient sampleHeightAndGradient(const float *nodes, const Index &index, float posX, float posY) const;
+    using DropletFunction = int (Erosion::*)(const HeightmapView &map, float posX, float posY, ErosionStats *activeStats);
+
+    // Radius 0 is the generic kernel, other radii have the brush of interior cells unrolled at compile time.
+    // Index is the cell layout, RowMajorIndex or BlockedIndex
+    template<bool CollectStats, int Radius, class Index>
+    int simulateDroplet(const HeightmapView &map, float posX, float posY, ErosionStats *activeStats);
+    // Carries a droplet on from its state until it stops, with Bounded also once its cell leaves rows
+    // [firstRow, endRow), which leaves the state where the next eroder carries on. True if it left the rows
+    template<bool CollectStats, int Radius, class Index, bool Bounded>
+    bool flowDroplet(const HeightmapView &map, DropletState &droplet, int firstRow, int endRow,
+                     ErosionStats *activeStats);
+    using BandFunction = bool (Erosion::*)(const HeightmapView &map, DropletState &droplet, int firstRow, int endRow,
+                                           ErosionStats *activeStats);
+    template<bool CollectStats>
+    static BandFunction bandFunctionFor(int radius);
+    // Scalar kernel for the active layout, specialized for erosionRadius if there is one
+    DropletFunction dropletFunction(bool collectStats) const;
+    template<bool CollectStats, class Index>
+    static DropletFunction dropletFunctionFor(int radius);
+    long long simulateDroplets(ErosionKernel activeKernel, const HeightmapView &map,
+                               const float *spawnX, const float *spawnY, int count, ErosionStats *activeStats);
+    void spawnPosition(long long droplet, const SpawnArea &area, float &posX, float &posY) const;
+    void erodeArea(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                   ErosionKernel activeKernel, ErosionStats *activeStats);
+    void erodeSerial(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                     ErosionKernel activeKernel, ErosionStats *activeStats);
+    void erodeParallel(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                       ErosionKernel activeKernel, ErosionStats *activeStats);
+    void erodeBinned(const HeightmapView &map, const SpawnArea &area, long long firstDroplet, int numIterations,
+                     ErosionKernel activeKernel, ErosionStats *activeStats);
+
+    // Spawn positions of a batch of droplets sorted by the square of binSize cells they spawn in, spawn order kept
+    // inside each square. Bin b holds entries [binStart[b], binStart[b + 1]) of sortedX and sortedY
+    struct SpawnBins {
+        std::vector<float> spawnX;
+        std::vector<float> spawnY;
+        std::vector<int> spawnBin;
+        std::vector<float> sortedX;
+        std::vector<float> sortedY;
+        std::vector<int> binStart;
+    };
+    void binSpawns(const SpawnArea &area, long long batchStart, int batchSize, int binSize, int binsX,
+                   int numBins, SpawnBins &bins) const;
 };
 
 
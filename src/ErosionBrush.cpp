@@ -0,0 +1,105 @@
+#include "ErosionBrush.hpp"
+#include <algorithm>
+#include <cmath>
+
+ErosionBrush::ErosionBrush(int mapSize, int radius, HeightmapLayout layout)
+    : ErosionBrush(HeightmapView{nullptr, mapSize, mapSize, mapSize}, radius, layout) {
+}
+
+ErosionBrush::ErosionBrush(const HeightmapView& map, int radius, HeightmapLayout layout)
+    : width(map.width), height(map.height), stride(map.stride), radius(radius), layout(layout) {
+    // Brush points are within radius - 1 of the center, so a band of radius cells covers every clipped brush.
+    // Maps too small for an interior keep every cell in the table
+    bool noInterior = width <= 2 * radius || height <= 2 * radius;
+    band = noInterior ? std::max(width, height) : radius;
+
+    std::vector<int> xOffsets;
+    std::vector<int> yOffsets;
+    std::vector<float> weights;
+    float weightSum = 0;
+    for (int y = -radius; y <= radius; y++) {
+        for (int x = -radius; x <= radius; x++) {
+            float sqrDst = x * x + y * y;
+            if (sqrDst < radius * radius) {
+                float weight = 1 - std::sqrt(sqrDst) / radius;
+                weightSum += weight;
+                weights.push_back(weight);
+                xOffsets.push_back(x);
+                yOffsets.push_back(y);
+            }
+        }
+    }
+
+    int numPoints = (int)weights.size();
+    stencilOffsets.resize(numPoints);
+    stencilWeights.resize(numPoints);
+    for (int j = 0; j < numPoints; j++) {
+        stencilOffsets[j] = yOffsets[j] * stride + xOffsets[j];
+        stencilWeights[j] = weights[j] / weightSum;
+    }
+    stencilXOffsets = xOffsets;
+    stencilYOffsets = yOffsets;
+    BlockedIndex blockedIndex(width);
+
+    int sideRows = height - 2 * band;
+    int numBorderCells = noInterior ? width * height : 2 * band * width + sideRows * 2 * band;
+    borderStart.reserve(numBorderCells + 1);
+    borderStart.push_back(0);
+    borderIndices.reserve((size_t)numBorderCells * numPoints);
+    borderWeights.reserve((size_t)numBorderCells * numPoints);
+
+    std::vector<int> clippedPoints(numPoints);
+    for (int centerY = 0; centerY < height; centerY++) {
+        bool sideRow = centerY >= band && centerY < height - band;
+        for (int centerX = 0; centerX < width; centerX++) {
+            if (sideRow && centerX == band) {
+                // Skip the interior of the row, it uses the shared stencil
+                centerX = width - band - 1;
+                continue;
+            }
+
+            int numEntries = 0;
+            float clippedSum = 0;
+            for (int j = 0; j < numPoints; j++) {
+                int coordX = centerX + xOffsets[j];
+                int coordY = centerY + yOffsets[j];
+                if (coordX >= 0 && coordX < width && coordY >= 0 && coordY < height) {
+                    clippedSum += weights[j];
+                    clippedPoints[numEntries++] = j;
+                }
+            }
+
+            for (int k = 0; k < numEntries; k++) {
+                int j = clippedPoints[k];
+                int coordX = xOffsets[j] + centerX;
+                int coordY = yOffsets[j] + centerY;
+                borderIndices.push_back(layout == HeightmapLayout::Blocked ? blockedIndex(coordX, coordY)
+                                                                           : coordY * stride + coordX);
+                borderWeights.push_back(weights[j] / clippedSum);
+            }
+            borderStart.push_back((int)borderIndices.size());
+        }
+    }
+}
+
+size_t ErosionBrush::memoryUsage() const {
+    return stencilOffsets.capacity() * sizeof(int) + stencilWeights.capacity() * sizeof(float)
+        + stencilXOffsets.capacity() * sizeof(int) + stencilYOffsets.capacity() * sizeof(int)
+        + borderStart.capacity() * sizeof(int) + borderIndices.capacity() * sizeof(int)
+        + borderWeights.capacity() * sizeof(float);
+}
+
+PacketKernelArgs ErosionBrush::packetArgs() const {
+    PacketKernelArgs args = {};
+    args.mapWidth = width;
+    args.mapHeight = height;
+    args.mapStride = stride;
+    args.brushBand = band;
+    args.stencilOffsets = stencilOffsets.data();
+    args.stencilWeights = stencilWeights.data();
+    args.stencilSize = (int)stencilOffsets.size();
+    args.borderStart = borderStart.data();
+    args.borderIndices = borderIndices.data();
+    args.borderWeights = borderWeights.data();
+    return args;
+}
@@ -0,0 +1,91 @@
+#ifndef EROSIONBRUSH_HPP
+#define EROSIONBRUSH_HPP
+
+
+#include <cstddef>
+#include <vector>
+#include "DropletPacket.hpp"
+#include "Heightmap.hpp"
+
+// Brush points of one cell, the node index of point k is base + offsets[k].
+// Interior cells of a brush for a layout other than row-major have no constant offsets, see stencilX and stencilY
+struct BrushSpan {
+    const int* offsets;
+    const float* weights;
+    int size;
+    int base;
+};
+
+// Erosion brush for every cell of a map.
+// Cells whose whole brush lies inside the map share one stencil of relative offsets,
+// only the cells in the border band get their own clipped and renormalized rows in a flat table.
+// Border rows hold node indices in the storage order of the layout.
+class ErosionBrush {
+public:
+    ErosionBrush(const HeightmapView& map, int radius, HeightmapLayout layout = HeightmapLayout::RowMajor);
+    ErosionBrush(int mapSize, int radius, HeightmapLayout layout = HeightmapLayout::RowMajor);
+
+    int width;
+    int height;
+    int stride;
+    int radius;
+    HeightmapLayout layout;
+
+    // Whether the brush was built for a map of this shape
+    bool fits(const HeightmapView& map) const {
+        return map.width == width && map.height == height && map.stride == stride;
+    }
+
+    // Whether the cell's brush lies inside the map and uses the shared stencil
+    bool isInterior(int x, int y) const {
+        return x >= band && x < width - band && y >= band && y < height - band;
+    }
+
+    BrushSpan at(int x, int y) const {
+        if (isInterior(x, y)) {
+            return {stencilOffsets.data(), stencilWeights.data(), (int)stencilOffsets.size(), y * stride + x};
+        }
+        int row = borderRow(x, y);
+        int start = borderStart[row];
+        return {&borderIndices[start], &borderWeights[start], borderStart[row + 1] - start, 0};
+    }
+
+    // Cell offsets of the stencil points, in the same order as the stencil
+    const int* stencilX() const { return stencilXOffsets.data(); }
+    const int* stencilY() const { return stencilYOffsets.data(); }
+
+    // Kernel arguments with the brush tables filled in
+    PacketKernelArgs packetArgs() const;
+
+    // Bytes held by the stencil and the border table
+    size_t memoryUsage() const;
+
+private:
+    // Width of the border band, cells closer than this to an edge may have their brush clipped.
+    // Maps too small for an interior have a band covering everything
+    int band;
+
+    std::vector<int> stencilOffsets;
+    std::vector<float> stencilWeights;
+    std::vector<int> stencilXOffsets;
+    std::vector<int> stencilYOffsets;
+
+    // Border cells in row-major order, row r owns entries [borderStart[r], borderStart[r + 1])
+    std::vector<int> borderStart;
+    std::vector<int> borderIndices;
+    std::vector<float> borderWeights;
+
+    int borderRow(int x, int y) const {
+        if (y < band) {
+            return y * width + x;
+        }
+        int sideRows = height - 2 * band;
+        if (y >= height - band) {
+            return band * width + sideRows * 2 * band + (y - (height - band)) * width + x;
+        }
+        return band * width + (y - band) * 2 * band + (x < band ? x : x - (width - 2 * band));
+    }
+};
+
+
+#endif
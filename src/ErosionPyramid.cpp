@@ -0,0 +1,152 @@
+#include "ErosionPyramid.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+std::vector<PyramidLevel> pyramidSchedule(int numIterations, int numLevels) {
+    std::vector<PyramidLevel> levels;
+    for (int level = std::max(1, numLevels) - 1; level >= 0; level--) {
+        int scale = 1 << level;
+        long long droplets = (long long)numIterations >> std::min(62, 2 + 4 * level);
+        levels.push_back({scale, (int)std::max(1LL, droplets)});
+    }
+    return levels;
+}
+
+bool parsePyramidSchedule(const std::string &text, std::vector<PyramidLevel> &levels) {
+    levels.clear();
+    std::istringstream in(text);
+    std::string entry;
+    while (std::getline(in, entry, ',')) {
+        size_t colon = entry.find(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        int scale = atoi(entry.substr(0, colon).c_str());
+        int droplets = atoi(entry.substr(colon + 1).c_str());
+        if (scale < 1 || droplets < 0) {
+            return false;
+        }
+        levels.push_back({scale, droplets});
+    }
+    return !levels.empty();
+}
+
+// Size of a map of size cells shrunk by scale, partial cells at the end count as whole ones
+static int levelSize(int size, int scale) {
+    return (size + scale - 1) / scale;
+}
+
+// Each cell of the level is the mean of the map cells it covers
+static std::vector<float> downsample(const HeightmapView &map, int scale) {
+    int width = levelSize(map.width, scale);
+    int height = levelSize(map.height, scale);
+    std::vector<float> level((size_t)width * height);
+    std::vector<float> rowSums(width);
+    for (int y = 0; y < height; y++) {
+        std::fill(rowSums.begin(), rowSums.end(), 0.0f);
+        int lastRow = std::min(map.height, (y + 1) * scale);
+        for (int mapY = y * scale; mapY < lastRow; mapY++) {
+            const float* row = map.data + (size_t)mapY * map.stride;
+            for (int mapX = 0; mapX < map.width; mapX++) {
+                rowSums[mapX / scale] += row[mapX];
+            }
+        }
+        for (int x = 0; x < width; x++) {
+            int cells = (std::min(map.width, (x + 1) * scale) - x * scale) * (lastRow - y * scale);
+            level[(size_t)y * width + x] = rowSums[x] / cells;
+        }
+    }
+    return level;
+}
+
+// Adds the coarse map, sampled bilinearly at the cell centers of the fine one, onto the fine map.
+// ratio is how many fine cells a coarse cell spans along each side
+static void upsampleAdd(const std::vector<float> &coarse, int coarseWidth, int coarseHeight, float ratio,
+                        const HeightmapView &fine) {
+    std::vector<int> columns(fine.width);
+    std::vector<float> columnOffsets(fine.width);
+    for (int x = 0; x < fine.width; x++) {
+        float coarseX = std::clamp((x + 0.5f) / ratio - 0.5f, 0.0f, (float)(coarseWidth - 1));
+        columns[x] = std::min((int)coarseX, coarseWidth - 2);
+        columnOffsets[x] = coarseX - columns[x];
+    }
+
+    for (int y = 0; y < fine.height; y++) {
+        float coarseY = std::clamp((y + 0.5f) / ratio - 0.5f, 0.0f, (float)(coarseHeight - 1));
+        int row = std::min((int)coarseY, coarseHeight - 2);
+        float offsetY = coarseY - row;
+        const float* top = &coarse[(size_t)row * coarseWidth];
+        const float* bottom = top + coarseWidth;
+        float* out = fine.data + (size_t)y * fine.stride;
+        for (int x = 0; x < fine.width; x++) {
+            int column = columns[x];
+            float offsetX = columnOffsets[x];
+            float upper = top[column] * (1 - offsetX) + top[column + 1] * offsetX;
+            float lower = bottom[column] * (1 - offsetX) + bottom[column + 1] * offsetX;
+            out[x] += upper * (1 - offsetY) + lower * offsetY;
+        }
+    }
+}
+
+bool erodePyramid(Erosion &eroder, const HeightmapView &map, const std::vector<PyramidLevel> &levels,
+                  bool resetSeed) {
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width || levels.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < levels.size(); i++) {
+        int scale = levels[i].scale;
+        if (scale < 1 || (i > 0 && scale >= levels[i - 1].scale) || levels[i].numIterations < 0 ||
+            levelSize(map.width, scale) < 2 || levelSize(map.height, scale) < 2) {
+            return false;
+        }
+    }
+
+    ErosionStats totalStats = {};
+    // Erosion of the last level done so far at its own resolution, the level minus the map shrunk to it.
+    // Upsampling it onto the next level is the same as upsampling the eroded level and adding the detail
+    // residual the next level has over it
+    std::vector<float> change;
+    int changeWidth = 0;
+    int changeHeight = 0;
+    int changeScale = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        const PyramidLevel &level = levels[i];
+        std::vector<float> cells;
+        HeightmapView levelView = map;
+        if (level.scale > 1) {
+            cells = downsample(map, level.scale);
+            levelView = {cells.data(), levelSize(map.width, level.scale), levelSize(map.height, level.scale),
+                         levelSize(map.width, level.scale)};
+        }
+        std::vector<float> original = cells;
+        if (changeScale > 0) {
+            upsampleAdd(change, changeWidth, changeHeight, (float)changeScale / level.scale, levelView);
+        }
+
+        eroder.erode(levelView, level.numIterations, resetSeed && i == 0);
+        if (eroder.collectStats) {
+            totalStats.merge(eroder.stats);
+        }
+
+        if (level.scale > 1) {
+            for (size_t cell = 0; cell < cells.size(); cell++) {
+                cells[cell] -= original[cell];
+            }
+            change = std::move(cells);
+            changeWidth = levelView.width;
+            changeHeight = levelView.height;
+            changeScale = level.scale;
+        } else {
+            changeScale = 0;
+        }
+    }
+    if (changeScale > 0) {
+        upsampleAdd(change, changeWidth, changeHeight, (float)changeScale, map);
+    }
+
+    if (eroder.collectStats) {
+        eroder.stats = totalStats;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef EROSIONPYRAMID_HPP
+#define EROSIONPYRAMID_HPP
+
+
+#include <string>
+#include <vector>
+#include "Erosion.hpp"
+
+// One level of a coarse-to-fine erosion schedule
+struct PyramidLevel {
+    // The level erodes the map shrunk by this factor along each side
+    int scale;
+    int numIterations;
+};
+
+// Schedule of numLevels levels with scales 2^(numLevels - 1) down to 1 that looks about like numIterations droplets
+// at full resolution. A level of scale s runs numIterations / (4 * s^4) droplets, s^2 fewer cells each getting
+// 4 * s^2 fewer droplets. The factor was tuned against full resolution runs, not derived from how much a coarse
+// droplet carves. On a 1024 x 1024 map three levels match a full run of half the droplets with a quarter of the
+// droplet steps
+std::vector<PyramidLevel> pyramidSchedule(int numIterations, int numLevels);
+// Schedule written as scale:droplets pairs from coarse to fine, as in "4:2000,2:30000,1:500000"
+bool parsePyramidSchedule(const std::string &text, std::vector<PyramidLevel> &levels);
+
+// Erodes a row-major map coarse to fine. Each level starts from the map box-filtered down to its scale plus the
+// erosion of the coarser levels, upsampled bilinearly: it inherits the large features and keeps its own detail.
+// A level of scale 1 erodes the map in place, otherwise the change of the last level is upsampled onto it.
+// Droplets carry on from the eroder's cursor, resetSeed resets it before the first level. With collectStats the
+// eroder's stats cover every level. False if the map is invalid, levels is empty, the scales don't decrease
+// or a level would be smaller than 2 x 2 cells
+bool erodePyramid(Erosion &eroder, const HeightmapView &map, const std::vector<PyramidLevel> &levels,
+                  bool resetSeed = false);
+
+
+#endif
@@ -0,0 +1,49 @@
+#include "ErosionStats.hpp"
+#include <ostream>
+
+void ErosionStats::reset() {
+    *this = ErosionStats();
+}
+
+void ErosionStats::merge(const ErosionStats& other) {
+    for (int i = 0; i < histogramBins; i++) {
+        lifetimeHistogram[i] += other.lifetimeHistogram[i];
+    }
+    droplets += other.droplets;
+    offMapExits += other.offMapExits;
+    zeroDirectionExits += other.zeroDirectionExits;
+    expiredDroplets += other.expiredDroplets;
+    erodeSteps += other.erodeSteps;
+    depositSteps += other.depositSteps;
+    sedimentEroded += other.sedimentEroded;
+    sedimentDeposited += other.sedimentDeposited;
+    brushSeconds += other.brushSeconds;
+    simulationSeconds += other.simulationSeconds;
+    outputSeconds += other.outputSeconds;
+}
+
+void ErosionStats::writeJson(std::ostream& out) const {
+    // Trailing empty bins are left out
+    int usedBins = histogramBins;
+    while (usedBins > 0 && lifetimeHistogram[usedBins - 1] == 0) {
+        usedBins--;
+    }
+
+    out << "{\n";
+    out << "  \"droplets\": " << droplets << ",\n";
+    out << "  \"offMapExits\": " << offMapExits << ",\n";
+    out << "  \"zeroDirectionExits\": " << zeroDirectionExits << ",\n";
+    out << "  \"expiredDroplets\": " << expiredDroplets << ",\n";
+    out << "  \"erodeSteps\": " << erodeSteps << ",\n";
+    out << "  \"depositSteps\": " << depositSteps << ",\n";
+    out << "  \"sedimentEroded\": " << sedimentEroded << ",\n";
+    out << "  \"sedimentDeposited\": " << sedimentDeposited << ",\n";
+    out << "  \"brushSeconds\": " << brushSeconds << ",\n";
+    out << "  \"simulationSeconds\": " << simulationSeconds << ",\n";
+    out << "  \"outputSeconds\": " << outputSeconds << ",\n";
+    out << "  \"lifetimeHistogram\": [";
+    for (int i = 0; i < usedBins; i++) {
+        out << (i ? ", " : "") << lifetimeHistogram[i];
+    }
+    out << "]\n}\n";
+}
@@ -0,0 +1,38 @@
+#ifndef EROSIONSTATS_HPP
+#define EROSIONSTATS_HPP
+
+
+#include <iosfwd>
+
+// What the droplets of an erode call did, filled in when Erosion::collectStats is set
+struct ErosionStats {
+    // lifetimeHistogram[n] counts droplets that took n steps, the last bin holds everything longer
+    static constexpr int histogramBins = 129;
+    long long lifetimeHistogram[histogramBins];
+
+    long long droplets;
+    // Droplets that flowed over the edge of the map
+    long long offMapExits;
+    // Droplets that stopped on flat ground
+    long long zeroDirectionExits;
+    // Droplets still moving when they reached maxDropletLifetime
+    long long expiredDroplets;
+
+    long long erodeSteps;
+    long long depositSteps;
+    double sedimentEroded;
+    double sedimentDeposited;
+
+    // Wall time of the brush setup, the droplet loop and writing the result (set by the caller)
+    double brushSeconds;
+    double simulationSeconds;
+    double outputSeconds;
+
+    void reset();
+    void merge(const ErosionStats& other);
+    void recordLifetime(int steps) { lifetimeHistogram[steps < histogramBins ? steps : histogramBins - 1]++; }
+    void writeJson(std::ostream& out) const;
+};
+
+
+#endif
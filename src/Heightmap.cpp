@@ -0,0 +1,57 @@
+#include "Heightmap.hpp"
+#include <algorithm>
+#include <cstring>
+
+Heightmap::Heightmap(int size, HeightmapLayout layout) : mapSize(size), cellLayout(layout) {
+    if (layout == HeightmapLayout::Blocked) {
+        size_t blocksPerRow = BlockedIndex(size).blocksPerRow;
+        cells.resize(blocksPerRow * blocksPerRow * BlockedIndex::blockSize * BlockedIndex::blockSize);
+    } else {
+        cells.resize((size_t)size * size);
+    }
+}
+
+void Heightmap::read(int x, int y, int width, int height, float* out, size_t stride) const {
+    if (cellLayout == HeightmapLayout::RowMajor) {
+        for (int row = 0; row < height; row++) {
+            std::memcpy(out + row * stride, &cells[(size_t)(y + row) * mapSize + x], width * sizeof(float));
+        }
+        return;
+    }
+    // Copy the run of every block this row crosses
+    BlockedIndex index(mapSize);
+    for (int row = 0; row < height; row++) {
+        for (int column = x; column < x + width;) {
+            int run = std::min(BlockedIndex::blockSize - (column & BlockedIndex::blockMask), x + width - column);
+            std::memcpy(out + row * stride + (column - x), &cells[index(column, y + row)], run * sizeof(float));
+            column += run;
+        }
+    }
+}
+
+void Heightmap::write(int x, int y, int width, int height, const float* in, size_t stride) {
+    if (cellLayout == HeightmapLayout::RowMajor) {
+        for (int row = 0; row < height; row++) {
+            std::memcpy(&cells[(size_t)(y + row) * mapSize + x], in + row * stride, width * sizeof(float));
+        }
+        return;
+    }
+    BlockedIndex index(mapSize);
+    for (int row = 0; row < height; row++) {
+        for (int column = x; column < x + width;) {
+            int run = std::min(BlockedIndex::blockSize - (column & BlockedIndex::blockMask), x + width - column);
+            std::memcpy(&cells[index(column, y + row)], in + row * stride + (column - x), run * sizeof(float));
+            column += run;
+        }
+    }
+}
+
+std::vector<float> Heightmap::toRowMajor() const {
+    std::vector<float> map((size_t)mapSize * mapSize);
+    read(0, 0, mapSize, mapSize, map.data(), mapSize);
+    return map;
+}
+
+void Heightmap::fromRowMajor(const std::vector<float>& map) {
+    write(0, 0, mapSize, mapSize, map.data(), mapSize);
+}
@@ -0,0 +1,79 @@
+#ifndef HEIGHTMAP_HPP
+#define HEIGHTMAP_HPP
+
+
+#include <cstddef>
+#include <vector>
+
+// How the cells of a Heightmap are ordered in memory
+enum class HeightmapLayout {
+    // Row after row, the layout of std::vector<float> maps and of every file format
+    RowMajor,
+    // Square blocks of 32 x 32 cells (one 4 KiB page each) in row-major block order, row-major inside a block.
+    // A droplet's bilinear reads and brush then touch a few pages instead of one page per row on large maps
+    Blocked
+};
+
+// Caller-owned heightmap of width x height cells. In row-major layout row y starts at data + y * stride,
+// blocked maps ignore the stride
+struct HeightmapView {
+    float* data;
+    int width;
+    int height;
+    int stride;
+};
+
+// Storage index of a cell for each layout, used by the kernels as compile-time policies
+struct RowMajorIndex {
+    static constexpr bool rowMajor = true;
+    int stride;
+
+    explicit RowMajorIndex(int stride) : stride(stride) {}
+    explicit RowMajorIndex(const HeightmapView& map) : stride(map.stride) {}
+    int operator()(int x, int y) const { return y * stride + x; }
+};
+
+struct BlockedIndex {
+    static constexpr bool rowMajor = false;
+    static constexpr int blockShift = 5;
+    static constexpr int blockSize = 1 << blockShift;
+    static constexpr int blockMask = blockSize - 1;
+    int blocksPerRow;
+
+    explicit BlockedIndex(int width) : blocksPerRow((width + blockMask) >> blockShift) {}
+    explicit BlockedIndex(const HeightmapView& map) : BlockedIndex(map.width) {}
+    int operator()(int x, int y) const {
+        int block = (y >> blockShift) * blocksPerRow + (x >> blockShift);
+        return (block << (2 * blockShift)) | ((y & blockMask) << blockShift) | (x & blockMask);
+    }
+};
+
+// Square heightmap with the cell layout chosen at construction.
+// Row-major data only goes in and out through the region copies, so conversion stays at the I/O boundary
+class Heightmap {
+public:
+    Heightmap(int size, HeightmapLayout layout);
+
+    int size() const { return mapSize; }
+    HeightmapLayout layout() const { return cellLayout; }
+    float* data() { return cells.data(); }
+    const float* data() const { return cells.data(); }
+    HeightmapView view() { return {cells.data(), mapSize, mapSize, mapSize}; }
+
+    // Copies a rectangle of the map to or from row-major memory with rows stride floats apart
+    void read(int x, int y, int width, int height, float* out, size_t stride) const;
+    void write(int x, int y, int width, int height, const float* in, size_t stride);
+
+    // Whole map in row-major order and back
+    std::vector<float> toRowMajor() const;
+    void fromRowMajor(const std::vector<float>& map);
+
+private:
+    int mapSize;
+    HeightmapLayout cellLayout;
+    // Blocked maps are padded to whole blocks, the padding is never read or written by erosion
+    std::vector<float> cells;
+};
+
+
+#endif
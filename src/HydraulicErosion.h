@@ -0,0 +1,49 @@
+#ifndef HYDRAULIC_EROSION_H
+#define HYDRAULIC_EROSION_H
+
+
+/* C interface of the hydraulic_erosion library, for callers that can't use the C++ classes.
+   Maps are caller-owned row-major floats, row y starts at data + y * stride */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct hydraulic_erosion_eroder hydraulic_erosion_eroder;
+
+typedef struct hydraulic_erosion_parameters {
+    int seed;
+    int erosion_radius;
+    float inertia;
+    float sediment_capacity_factor;
+    float min_sediment_capacity;
+    float erode_speed;
+    float deposit_speed;
+    float evaporate_speed;
+    float gravity;
+    float max_droplet_lifetime;
+    float initial_water_volume;
+    float initial_speed;
+    /* More than one thread runs the tiled schedule, whose map doesn't depend on the thread count
+       but differs from the one thread run */
+    int num_threads;
+} hydraulic_erosion_parameters;
+
+/* Parameters of a default constructed Erosion, seed 0 and one thread */
+hydraulic_erosion_parameters hydraulic_erosion_default_parameters(void);
+
+/* Null if the parameters are invalid */
+hydraulic_erosion_eroder* hydraulic_erosion_create(const hydraulic_erosion_parameters* parameters);
+void hydraulic_erosion_destroy(hydraulic_erosion_eroder* eroder);
+
+/* Simulates num_droplets droplets on the map in place. Calls after the first carry on with the next droplets
+   of the seed unless reset_seed is set. Returns 0 on success, -1 if the map or arguments are invalid */
+int hydraulic_erosion_erode(hydraulic_erosion_eroder* eroder, float* data, int width, int height, int stride,
+                            int num_droplets, int reset_seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
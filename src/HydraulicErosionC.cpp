@@ -0,0 +1,69 @@
+#include "HydraulicErosion.h"
+#include "Erosion.hpp"
+#include <new>
+
+struct hydraulic_erosion_eroder {
+    Erosion erosion;
+};
+
+hydraulic_erosion_parameters hydraulic_erosion_default_parameters(void) {
+    Erosion defaults;
+    hydraulic_erosion_parameters parameters;
+    parameters.seed = 0;
+    parameters.erosion_radius = defaults.erosionRadius;
+    parameters.inertia = defaults.inertia;
+    parameters.sediment_capacity_factor = defaults.sedimentCapacityFactor;
+    parameters.min_sediment_capacity = defaults.minSedimentCapacity;
+    parameters.erode_speed = defaults.erodeSpeed;
+    parameters.deposit_speed = defaults.depositSpeed;
+    parameters.evaporate_speed = defaults.evaporateSpeed;
+    parameters.gravity = defaults.gravity;
+    parameters.max_droplet_lifetime = defaults.maxDropletLifetime;
+    parameters.initial_water_volume = defaults.initialWaterVolume;
+    parameters.initial_speed = defaults.initialSpeed;
+    parameters.num_threads = defaults.numThreads;
+    return parameters;
+}
+
+hydraulic_erosion_eroder* hydraulic_erosion_create(const hydraulic_erosion_parameters* parameters) {
+    if (!parameters || parameters->erosion_radius < 1 || parameters->num_threads < 1) {
+        return nullptr;
+    }
+    hydraulic_erosion_eroder* eroder = new (std::nothrow) hydraulic_erosion_eroder();
+    if (!eroder) {
+        return nullptr;
+    }
+    Erosion& erosion = eroder->erosion;
+    erosion.seed = parameters->seed;
+    erosion.erosionRadius = parameters->erosion_radius;
+    erosion.inertia = parameters->inertia;
+    erosion.sedimentCapacityFactor = parameters->sediment_capacity_factor;
+    erosion.minSedimentCapacity = parameters->min_sediment_capacity;
+    erosion.erodeSpeed = parameters->erode_speed;
+    erosion.depositSpeed = parameters->deposit_speed;
+    erosion.evaporateSpeed = parameters->evaporate_speed;
+    erosion.gravity = parameters->gravity;
+    erosion.maxDropletLifetime = parameters->max_droplet_lifetime;
+    erosion.initialWaterVolume = parameters->initial_water_volume;
+    erosion.initialSpeed = parameters->initial_speed;
+    erosion.numThreads = parameters->num_threads;
+    erosion.schedule = parameters->num_threads > 1 ? DropletSchedule::Tiled : DropletSchedule::Sequential;
+    return eroder;
+}
+
+void hydraulic_erosion_destroy(hydraulic_erosion_eroder* eroder) {
+    delete eroder;
+}
+
+int hydraulic_erosion_erode(hydraulic_erosion_eroder* eroder, float* data, int width, int height, int stride,
+                            int num_droplets, int reset_seed) {
+    if (!eroder || num_droplets < 0) {
+        return -1;
+    }
+    // Nothing may throw across the C boundary, the thread pool and brush allocate
+    try {
+        return eroder->erosion.erode(HeightmapView{data, width, height, stride}, num_droplets, reset_seed != 0) ? 0 : -1;
+    } catch (...) {
+        return -1;
+    }
+}
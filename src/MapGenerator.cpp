@@ -0,0 +1,72 @@
+#include "MapGenerator.hpp"
+#include "../simplex/SimplexNoise.hpp"
+#include <algorithm>
+
+std::vector<float> generateMap(int resolution, int numThreads) {
+    ThreadPool pool(numThreads);
+    std::vector<float> buf((size_t)resolution * resolution);
+    generateMapRegion(resolution, 0, 0, resolution, resolution, buf.data(), resolution, &pool);
+    return buf;
+}
+
+void generateMap(Heightmap *map, int numThreads) {
+    ThreadPool pool(numThreads);
+    int resolution = map->size();
+    const int bandRows = 64;
+    std::vector<float> buf((size_t)bandRows * resolution);
+    for (int y = 0; y < resolution; y += bandRows) {
+        int height = std::min(bandRows, resolution - y);
+        generateMapRegion(resolution, 0, y, resolution, height, buf.data(), resolution, &pool);
+        map->write(0, y, resolution, height, buf.data(), resolution);
+    }
+}
+
+void generateMap(TiledHeightmap *map, int numThreads) {
+    ThreadPool pool(numThreads);
+    int resolution = map->size();
+    int tileSize = map->tileSize();
+    std::vector<float> buf((size_t)tileSize * tileSize);
+    for (int y = 0; y < resolution; y += tileSize) {
+        for (int x = 0; x < resolution; x += tileSize) {
+            int width = std::min(tileSize, resolution - x);
+            int height = std::min(tileSize, resolution - y);
+            generateMapRegion(resolution, x, y, width, height, buf.data(), width, &pool);
+            map->write(x, y, width, height, buf.data(), width);
+        }
+        map->release();
+    }
+}
+
+void generateMapRegion(int resolution, int x, int y, int width, int height, float *out, size_t stride,
+                       ThreadPool *pool) {
+    const SimplexNoise noise(1.0f, 0.5f, 1.99f, 0.5f);
+    const int rowsPerTask = 8;
+
+    // Each task fills a few rows with the batched fBm, one row per call
+    auto generateRows = [&](int task) {
+        std::vector<float> sampleX(width);
+        std::vector<float> sampleY(width);
+        int lastRow = std::min(height, (task + 1) * rowsPerTask);
+        for (int row = task * rowsPerTask; row < lastRow; row++) {
+            for (int column = 0; column < width; column++) {
+                long long i = (long long)(y + row) * resolution + x + column;
+                sampleX[column] = (float)i / resolution / resolution;
+                sampleY[column] = (i % resolution) / (float)resolution;
+            }
+            float *outRow = out + row * stride;
+            noise.fractal(8, width, sampleX.data(), sampleY.data(), outRow);
+            for (int column = 0; column < width; column++) {
+                outRow[column] = (outRow[column] + 1) / 2;
+            }
+        }
+    };
+
+    int numTasks = (height + rowsPerTask - 1) / rowsPerTask;
+    if (pool) {
+        pool->parallelFor(numTasks, generateRows);
+    } else {
+        for (int task = 0; task < numTasks; task++) {
+            generateRows(task);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef MAPGENERATOR_HPP
+#define MAPGENERATOR_HPP
+
+
+#include <cstddef>
+#include <vector>
+#include "Heightmap.hpp"
+#include "ThreadPool.hpp"
+#include "TiledHeightmap.hpp"
+
+// Square heightmap of fractal simplex noise with heights in [0, 1], rows are split across numThreads threads
+std::vector<float> generateMap(int resolution, int numThreads = 1);
+// Same noise for the map's size and layout, generated a band of rows at a time
+void generateMap(Heightmap *map, int numThreads = 1);
+// Same noise for the store's size, generated one tile at a time
+void generateMap(TiledHeightmap *map, int numThreads = 1);
+// A rectangle of the resolution x resolution map, written to rows stride floats apart.
+// Rows are shared out over the pool when there is one
+void generateMapRegion(int resolution, int x, int y, int width, int height, float *out, size_t stride,
+                       ThreadPool *pool = nullptr);
+
+
+#endif
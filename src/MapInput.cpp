@@ -0,0 +1,262 @@
+#include "MapInput.hpp"
+#include <tiffio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool parseMapInputFormat(const std::string& name, MapInputFormat& format) {
+    if (name == "tiff") {
+        format = MapInputFormat::Tiff;
+    } else if (name == "float32") {
+        format = MapInputFormat::RawFloat32;
+    } else if (name == "uint16") {
+        format = MapInputFormat::RawUInt16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseMapInputRange(const std::string& name, MapInputRange& range) {
+    if (name == "normalize") {
+        range = MapInputRange::Normalize;
+    } else if (name == "raw") {
+        range = MapInputRange::Raw;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+MapInputFormat mapInputFormatOf(const std::string& path) {
+    std::string extension = path.substr(std::min(path.size(), path.find_last_of('.')));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (extension == ".tif" || extension == ".tiff") {
+        return MapInputFormat::Tiff;
+    }
+    return extension == ".r16" ? MapInputFormat::RawUInt16 : MapInputFormat::RawFloat32;
+}
+
+MapInput::~MapInput() {
+    close();
+}
+
+void MapInput::close() {
+    if (mapping) {
+        munmap((void*)mapping, mappingSize);
+        mapping = nullptr;
+    }
+    if (fileHandle >= 0) {
+        ::close(fileHandle);
+        fileHandle = -1;
+    }
+    if (tiff) {
+        TIFFClose((TIFF*)tiff);
+        tiff = nullptr;
+    }
+    mapSize = 0;
+}
+
+bool MapInput::open(const std::string& path, MapInputFormat format, std::string& error) {
+    close();
+    inputFormat = format;
+
+    if (format == MapInputFormat::Tiff) {
+        TIFF* file = TIFFOpen(path.c_str(), "r");
+        if (!file) {
+            error = "Could not read " + path;
+            return false;
+        }
+        tiff = file;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint16_t bits = 0;
+        uint16_t sampleFormat = SAMPLEFORMAT_UINT;
+        uint16_t samplesPerPixel = 1;
+        TIFFGetField(file, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(file, TIFFTAG_IMAGELENGTH, &height);
+        TIFFGetFieldDefaulted(file, TIFFTAG_BITSPERSAMPLE, &bits);
+        TIFFGetFieldDefaulted(file, TIFFTAG_SAMPLEFORMAT, &sampleFormat);
+        TIFFGetFieldDefaulted(file, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+        bitsPerSample = bits;
+        floatSamples = sampleFormat == SAMPLEFORMAT_IEEEFP;
+        bool supported = floatSamples ? bits == 32 : sampleFormat == SAMPLEFORMAT_UINT && (bits == 8 || bits == 16);
+        if (samplesPerPixel != 1 || !supported) {
+            error = path + " isn't a single channel TIFF of 8 or 16 bit unsigned or 32 bit float samples";
+            close();
+            return false;
+        }
+        if (width != height || width < 2) {
+            error = path + " isn't a square map";
+            close();
+            return false;
+        }
+        mapSize = (int)width;
+        return true;
+    }
+
+    fileHandle = ::open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (fileHandle < 0 || fstat(fileHandle, &status) != 0) {
+        error = "Could not read " + path;
+        close();
+        return false;
+    }
+    size_t cellSize = format == MapInputFormat::RawUInt16 ? sizeof(uint16_t) : sizeof(float);
+    size_t cells = (size_t)status.st_size / cellSize;
+    size_t side = (size_t)std::llround(std::sqrt((double)cells));
+    if (cells * cellSize != (size_t)status.st_size || side * side != cells || side < 2 || side > (1 << 30)) {
+        error = path + " doesn't hold a square map";
+        close();
+        return false;
+    }
+
+    mappingSize = (size_t)status.st_size;
+    void* address = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fileHandle, 0);
+    if (address == MAP_FAILED) {
+        error = "Could not map " + path;
+        close();
+        return false;
+    }
+    mapping = (const unsigned char*)address;
+    // Read once front to back, the kernel can read ahead and drop pages behind
+    madvise(address, mappingSize, MADV_SEQUENTIAL);
+    mapSize = (int)side;
+    floatSamples = format == MapInputFormat::RawFloat32;
+    bitsPerSample = floatSamples ? 32 : 16;
+    return true;
+}
+
+// Converts count samples to float, unsigned ones scaled to [0, 1]
+static void convertSamples(const unsigned char* in, int bits, bool floatSamples, size_t count, float* out) {
+    if (floatSamples) {
+        std::memcpy(out, in, count * sizeof(float));
+    } else if (bits == 16) {
+        for (size_t i = 0; i < count; i++) {
+            uint16_t sample;
+            std::memcpy(&sample, in + i * sizeof(uint16_t), sizeof(uint16_t));
+            out[i] = sample / 65535.0f;
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = in[i] / 255.0f;
+        }
+    }
+}
+
+bool MapInput::forEachBlock(const BlockFunction& block) {
+    size_t sampleSize = bitsPerSample / 8;
+
+    if (mapping) {
+        // Bands of rows converted straight out of the mapping
+        const int bandRows = 64;
+        std::vector<float> band((size_t)bandRows * mapSize);
+        for (int y = 0; y < mapSize; y += bandRows) {
+            int rows = std::min(bandRows, mapSize - y);
+            convertSamples(mapping + (size_t)y * mapSize * sampleSize, bitsPerSample, floatSamples,
+                           (size_t)rows * mapSize, band.data());
+            block(0, y, mapSize, rows, band.data(), mapSize);
+        }
+        return true;
+    }
+
+    TIFF* file = (TIFF*)tiff;
+    if (TIFFIsTiled(file)) {
+        uint32_t tileWidth = 0;
+        uint32_t tileHeight = 0;
+        TIFFGetField(file, TIFFTAG_TILEWIDTH, &tileWidth);
+        TIFFGetField(file, TIFFTAG_TILELENGTH, &tileHeight);
+        std::vector<unsigned char> encoded(TIFFTileSize(file));
+        std::vector<float> values((size_t)tileWidth * tileHeight);
+        for (uint32_t y = 0; y < (uint32_t)mapSize; y += tileHeight) {
+            for (uint32_t x = 0; x < (uint32_t)mapSize; x += tileWidth) {
+                if (TIFFReadEncodedTile(file, TIFFComputeTile(file, x, y, 0, 0), encoded.data(), encoded.size()) < 0) {
+                    return false;
+                }
+                convertSamples(encoded.data(), bitsPerSample, floatSamples, values.size(), values.data());
+                block(x, y, std::min(tileWidth, mapSize - x), std::min(tileHeight, mapSize - y), values.data(),
+                      tileWidth);
+            }
+        }
+    } else {
+        uint32_t rowsPerStrip = mapSize;
+        TIFFGetFieldDefaulted(file, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip);
+        rowsPerStrip = std::min(rowsPerStrip, (uint32_t)mapSize);
+        std::vector<unsigned char> encoded(TIFFStripSize(file));
+        std::vector<float> values((size_t)rowsPerStrip * mapSize);
+        for (uint32_t y = 0; y < (uint32_t)mapSize; y += rowsPerStrip) {
+            int rows = (int)std::min(rowsPerStrip, mapSize - y);
+            if (TIFFReadEncodedStrip(file, TIFFComputeStrip(file, y, 0), encoded.data(), encoded.size()) < 0) {
+                return false;
+            }
+            convertSamples(encoded.data(), bitsPerSample, floatSamples, (size_t)rows * mapSize, values.data());
+            block(0, y, mapSize, rows, values.data(), mapSize);
+        }
+    }
+    return true;
+}
+
+template<class Map>
+bool MapInput::readInto(Map* map) {
+    if (mapSize == 0 || map->size() != mapSize) {
+        return false;
+    }
+
+    auto missing = [&](float value) {
+        return std::isnan(value) || std::find(nodata.begin(), nodata.end(), value) != nodata.end();
+    };
+    float lowest = INFINITY;
+    float highest = -INFINITY;
+    bool decoded = forEachBlock([&](int, int, int width, int height, float* values, size_t stride) {
+        for (int row = 0; row < height; row++) {
+            const float* rowValues = values + row * stride;
+            for (int column = 0; column < width; column++) {
+                if (!missing(rowValues[column])) {
+                    lowest = std::min(lowest, rowValues[column]);
+                    highest = std::max(highest, rowValues[column]);
+                }
+            }
+        }
+    });
+    if (!decoded || lowest > highest) {
+        return false;
+    }
+
+    float offset = 0;
+    float scale = 1;
+    if (range == MapInputRange::Normalize) {
+        offset = lowest;
+        scale = highest > lowest ? 1 / (highest - lowest) : 0;
+    }
+    float fill = (lowest - offset) * scale;
+    return forEachBlock([&](int x, int y, int width, int height, float* values, size_t stride) {
+        for (int row = 0; row < height; row++) {
+            float* rowValues = values + row * stride;
+            for (int column = 0; column < width; column++) {
+                rowValues[column] = missing(rowValues[column]) ? fill : (rowValues[column] - offset) * scale;
+            }
+        }
+        map->write(x, y, width, height, values, stride);
+        if constexpr (std::is_same_v<Map, TiledHeightmap>) {
+            // Keep only the tiles still being filled resident
+            if (x + width == mapSize && ((y + height) % map->tileSize() == 0 || y + height == mapSize)) {
+                map->release();
+            }
+        }
+    });
+}
+
+bool MapInput::read(Heightmap* map) {
+    return readInto(map);
+}
+
+bool MapInput::read(TiledHeightmap* map) {
+    return readInto(map);
+}
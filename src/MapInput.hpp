@@ -0,0 +1,85 @@
+#ifndef MAPINPUT_HPP
+#define MAPINPUT_HPP
+
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include "Heightmap.hpp"
+#include "TiledHeightmap.hpp"
+
+enum class MapInputFormat {
+    // Single channel TIFF, strips or tiles, 8 or 16 bit unsigned or 32 bit float samples
+    Tiff,
+    // Headerless square maps in the byte order of the machine
+    RawFloat32,
+    RawUInt16
+};
+
+// How samples become heights. Unsigned samples are first taken as the fraction of their full range
+enum class MapInputRange {
+    // Lowest sample of the map to 0 and highest to 1, whatever the sample format
+    Normalize,
+    // Heights as they are in the file
+    Raw
+};
+
+// Names used on the command line: tiff, float32 and uint16
+bool parseMapInputFormat(const std::string& name, MapInputFormat& format);
+// normalize and raw
+bool parseMapInputRange(const std::string& name, MapInputRange& range);
+// .tif and .tiff are TIFF, .r16 raw uint16 and anything else raw float32
+MapInputFormat mapInputFormatOf(const std::string& path);
+
+// Existing heightmap read into a map to erode. Raw files are memory-mapped and TIFF files decoded a strip or tile
+// at a time, each converted straight into the map, so no full-size copy of the input is ever made.
+// One pass finds the lowest and highest sample with data, a second one writes the map
+class MapInput {
+public:
+    MapInput() = default;
+    ~MapInput();
+
+    MapInputRange range = MapInputRange::Normalize;
+    // Samples marking cells without data, as NaN samples always do. They are left out of the range and the cells
+    // get the lowest height of the map. The defaults are the usual voids of DEMs
+    std::vector<float> nodata = {-9999, -32768};
+
+    MapInput(const MapInput&) = delete;
+    MapInput& operator=(const MapInput&) = delete;
+
+    // Only square inputs can be opened, raw ones have to hold a whole square of cells.
+    // On failure error says why
+    bool open(const std::string& path, MapInputFormat format, std::string& error);
+    void close();
+
+    int size() const { return mapSize; }
+
+    // The map has to be size() cells across. False if it couldn't be decoded or no sample has data
+    bool read(Heightmap* map);
+    bool read(TiledHeightmap* map);
+
+private:
+    MapInputFormat inputFormat = MapInputFormat::RawFloat32;
+    int mapSize = 0;
+
+    // Raw inputs
+    int fileHandle = -1;
+    const unsigned char* mapping = nullptr;
+    size_t mappingSize = 0;
+
+    // TIFF inputs
+    void* tiff = nullptr;
+    int bitsPerSample = 0;
+    bool floatSamples = false;
+
+    // Calls block(x, y, width, height, values, stride) with every rectangle of the input in file order,
+    // converted to float but not yet normalized or filled in. False if decoding failed
+    using BlockFunction = std::function<void(int x, int y, int width, int height, float* values, size_t stride)>;
+    bool forEachBlock(const BlockFunction& block);
+    template<class Map>
+    bool readInto(Map* map);
+};
+
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef PHILOX_HPP
+#define PHILOX_HPP
+
+
+#include <array>
+#include <cstdint>
+
+// Counter-based random numbers, Philox4x32-10 from Salmon et al. "Parallel random numbers: as easy as 1, 2, 3".
+// Each block of four words is a pure function of (key, counter), so any block can be computed on its own
+// and in any order.
+struct Philox4x32 {
+    static std::array<uint32_t, 4> generate(uint64_t counter, uint64_t key) {
+        std::array<uint32_t, 4> block = {(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0};
+        uint32_t key0 = (uint32_t)key;
+        uint32_t key1 = (uint32_t)(key >> 32);
+
+        for (int round = 0; round < 10; round++) {
+            uint64_t product0 = (uint64_t)0xD2511F53 * block[0];
+            uint64_t product1 = (uint64_t)0xCD9E8D57 * block[2];
+            block = {(uint32_t)(product1 >> 32) ^ block[1] ^ key0, (uint32_t)product1,
+                     (uint32_t)(product0 >> 32) ^ block[3] ^ key1, (uint32_t)product0};
+            key0 += 0x9E3779B9;
+            key1 += 0xBB67AE85;
+        }
+        return block;
+    }
+
+    // Uniform float in [0, 1) from the top 24 bits of a word
+    static float toUnitFloat(uint32_t bits) {
+        return (bits >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+
+#endif
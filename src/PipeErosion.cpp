@@ -0,0 +1,275 @@
+#include "PipeErosion.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Depth below which a cell counts as dry when turning flow into velocity
+static const float minWaterDepth = 1e-4f;
+
+void PipeErosion::reset(int mapWidth, int mapHeight) {
+    width = mapWidth;
+    height = mapHeight;
+    paddedWidth = width + 2;
+    size_t cells = (size_t)paddedWidth * (height + 2);
+    for (std::vector<float>* grid : {&terrain, &terrainNext, &water, &sediment, &sedimentNext, &fluxLeft, &fluxRight,
+                                     &fluxTop, &fluxBottom, &velocityX, &velocityY, &capacity}) {
+        grid->assign(cells, 0);
+    }
+}
+
+bool PipeErosion::erode(const HeightmapView &map, int numSteps, bool resetState) {
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width) {
+        return false;
+    }
+    if (resetState || map.width != width || map.height != height) {
+        reset(map.width, map.height);
+    }
+    if (!threadPool || threadPool->size() != numThreads) {
+        threadPool = std::make_unique<ThreadPool>(numThreads);
+    }
+
+    // The map may have changed since the last call, terrain is copied in and out once per call
+    forEachBand([&](int firstRow, int lastRow) {
+        for (int y = firstRow; y < lastRow; y++) {
+            std::copy_n(map.data + (size_t)y * map.stride, width, &terrain[(size_t)(y + 1) * paddedWidth + 1]);
+            padRow(terrain, y);
+        }
+    });
+
+    for (int step = 0; step < numSteps; step++) {
+        forEachBand([this](int firstRow, int lastRow) { updateFlux(firstRow, lastRow); });
+        forEachBand([this](int firstRow, int lastRow) { updateWater(firstRow, lastRow); });
+        forEachBand([this](int firstRow, int lastRow) { erodeAndDeposit(firstRow, lastRow); });
+        forEachBand([this](int firstRow, int lastRow) { relaxSlopes(firstRow, lastRow); });
+        std::swap(terrain, terrainNext);
+        forEachBand([this](int firstRow, int lastRow) { transportSediment(firstRow, lastRow); });
+        std::swap(sediment, sedimentNext);
+    }
+
+    forEachBand([&](int firstRow, int lastRow) {
+        for (int y = firstRow; y < lastRow; y++) {
+            std::copy_n(&terrain[(size_t)(y + 1) * paddedWidth + 1], width, map.data + (size_t)y * map.stride);
+        }
+    });
+    return true;
+}
+
+void PipeErosion::settle(const HeightmapView &map) {
+    if (map.width != width || map.height != height) {
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        float* suspended = &sediment[(size_t)(y + 1) * paddedWidth + 1];
+        float* row = map.data + (size_t)y * map.stride;
+        for (int x = 0; x < width; x++) {
+            row[x] += suspended[x];
+            suspended[x] = 0;
+        }
+    }
+}
+
+double PipeErosion::totalWater() const {
+    double total = 0;
+    for (float depth : water) {
+        total += depth;
+    }
+    return total;
+}
+
+double PipeErosion::totalSediment() const {
+    double total = 0;
+    for (float amount : sediment) {
+        total += amount;
+    }
+    return total;
+}
+
+void PipeErosion::forEachBand(const std::function<void(int, int)> &pass) {
+    const int bandRows = 32;
+    int numBands = (height + bandRows - 1) / bandRows;
+    threadPool->parallelFor(numBands, [&](int band) {
+        pass(band * bandRows, std::min(height, (band + 1) * bandRows));
+    });
+}
+
+void PipeErosion::padRow(std::vector<float> &grid, int y) {
+    float* row = &grid[(size_t)(y + 1) * paddedWidth];
+    row[0] = row[1];
+    row[width + 1] = row[width];
+    if (y == 0) {
+        std::copy_n(row, paddedWidth, row - paddedWidth);
+    }
+    if (y == height - 1) {
+        std::copy_n(row, paddedWidth, row + paddedWidth);
+    }
+}
+
+// Row kernels of the passes, starting at the first cell of a row of the padded grids. The grids never alias
+// each other, which the restrict qualifiers tell the compiler so the loops vectorize without alias checks.
+// On x86 each one is also built for AVX2 and AVX-512 and picked when the program loads
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define PIPE_ROW_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define PIPE_ROW_CLONES
+#endif
+
+PIPE_ROW_CLONES
+static void fluxRow(const float* __restrict T, const float* __restrict d, float* __restrict fL,
+                    float* __restrict fR, float* __restrict fT, float* __restrict fB, int count, int up,
+                    float acceleration, float keepFlow, float dt) {
+    for (int i = 0; i < count; i++) {
+        // Flow through each pipe slows down with friction and speeds up with the difference in water surface height
+        float surface = T[i] + d[i];
+        float left = std::max(0.0f, fL[i] * keepFlow + acceleration * (surface - T[i - 1] - d[i - 1]));
+        float right = std::max(0.0f, fR[i] * keepFlow + acceleration * (surface - T[i + 1] - d[i + 1]));
+        float top = std::max(0.0f, fT[i] * keepFlow + acceleration * (surface - T[i - up] - d[i - up]));
+        float bottom = std::max(0.0f, fB[i] * keepFlow + acceleration * (surface - T[i + up] - d[i + up]));
+        // Scaled down so a cell never sends out more water than it holds
+        float outflow = (left + right + top + bottom) * dt;
+        float scale = std::min(1.0f, d[i] / std::max(outflow, 1e-30f));
+        fL[i] = left * scale;
+        fR[i] = right * scale;
+        fT[i] = top * scale;
+        fB[i] = bottom * scale;
+    }
+}
+
+PIPE_ROW_CLONES
+static void waterRow(const float* __restrict T, const float* __restrict fL, const float* __restrict fR,
+                     const float* __restrict fT, const float* __restrict fB, float* __restrict d,
+                     float* __restrict u, float* __restrict v, float* __restrict C, int count, int up, float dt,
+                     float capacityFactor, float minTilt) {
+    for (int i = 0; i < count; i++) {
+        float outflow = fL[i] + fR[i] + fT[i] + fB[i];
+        float inflow = fR[i - 1] + fL[i + 1] + fB[i - up] + fT[i + up];
+        float depth = d[i];
+        float newDepth = std::max(0.0f, depth + dt * (inflow - outflow));
+
+        // Velocity is the water passing through the cell over the mean depth during the step
+        float passingX = 0.5f * (fR[i - 1] - fL[i] + fR[i] - fL[i + 1]);
+        float passingY = 0.5f * (fB[i - up] - fT[i] + fB[i] - fT[i + up]);
+        float meanDepth = std::max(0.5f * (depth + newDepth), minWaterDepth);
+        float velX = passingX / meanDepth;
+        float velY = passingY / meanDepth;
+
+        // Sine of the terrain slope from central differences
+        float gradientX = 0.5f * (T[i + 1] - T[i - 1]);
+        float gradientY = 0.5f * (T[i + up] - T[i - up]);
+        float sqrGradient = gradientX * gradientX + gradientY * gradientY;
+        float tilt = std::sqrt(sqrGradient / (1 + sqrGradient));
+
+        d[i] = newDepth;
+        u[i] = velX;
+        v[i] = velY;
+        C[i] = capacityFactor * std::max(tilt, minTilt) * std::sqrt(velX * velX + velY * velY) * newDepth;
+    }
+}
+
+PIPE_ROW_CLONES
+static void erodeRow(float* __restrict T, float* __restrict s, const float* __restrict C, const float* __restrict d,
+                     int count, float erodeRate, float depositRate, float maxDelta, float depthScale) {
+    for (int i = 0; i < count; i++) {
+        // Below capacity the water picks up a fraction of the difference, above it drops one.
+        // Picking up fades out with depth and neither exceeds maxDelta, so pooled water can't keep digging
+        float difference = C[i] - s[i];
+        float erodeFactor = erodeRate * std::max(0.0f, 1 - d[i] * depthScale);
+        float delta = difference > 0 ? std::min(erodeFactor * difference, maxDelta)
+                                     : std::max(depositRate * difference, -maxDelta);
+        T[i] -= delta;
+        s[i] += delta;
+    }
+}
+
+PIPE_ROW_CLONES
+static void relaxRow(const float* __restrict T, float* __restrict next, int count, int up, float talus,
+                     float rate) {
+    for (int i = 0; i < count; i++) {
+        // Each pair of neighbors steeper than talus evens out the excess from both sides, so terrain is only moved
+        float h = T[i];
+        float change = 0;
+        for (int neighbor : {-1, 1, -up, up}) {
+            float difference = T[i + neighbor] - h;
+            change += std::copysign(std::max(0.0f, std::abs(difference) - talus), difference);
+        }
+        next[i] = h + rate * change;
+    }
+}
+
+// Sediment is whole grid, the other grids start at the row
+PIPE_ROW_CLONES
+static void transportRow(const float* __restrict s, const float* __restrict u, const float* __restrict v,
+                         float* __restrict next, float* __restrict d, int width, int height, int y, int up,
+                         float dt, float keep, float rain) {
+    for (int x = 0; x < width; x++) {
+        // Sediment arriving here is whatever was one step upstream, sampled bilinearly inside the map
+        float fromX = std::clamp(x - u[x] * dt, 0.0f, (float)(width - 1));
+        float fromY = std::clamp(y - v[x] * dt, 0.0f, (float)(height - 1));
+        int cellX = std::min((int)fromX, width - 2);
+        int cellY = std::min((int)fromY, height - 2);
+        float offsetX = fromX - cellX;
+        float offsetY = fromY - cellY;
+        int from = (cellY + 1) * up + cellX + 1;
+        next[x] = (s[from] * (1 - offsetX) + s[from + 1] * offsetX) * (1 - offsetY) +
+                  (s[from + up] * (1 - offsetX) + s[from + up + 1] * offsetX) * offsetY;
+
+        d[x] = d[x] * keep + rain;
+    }
+}
+
+void PipeErosion::updateFlux(int firstRow, int lastRow) {
+    // Pipes have a cross section and length of one cell
+    float acceleration = timeStep * gravity;
+    float keepFlow = 1 - friction * timeStep;
+    for (int y = firstRow; y < lastRow; y++) {
+        size_t rowStart = (size_t)(y + 1) * paddedWidth + 1;
+        fluxRow(&terrain[rowStart], &water[rowStart], &fluxLeft[rowStart], &fluxRight[rowStart], &fluxTop[rowStart],
+                &fluxBottom[rowStart], width, paddedWidth, acceleration, keepFlow, timeStep);
+        // Nothing flows through the edges of the map
+        fluxLeft[rowStart] = 0;
+        fluxRight[rowStart + width - 1] = 0;
+        if (y == 0) {
+            std::fill_n(&fluxTop[rowStart], width, 0.0f);
+        }
+        if (y == height - 1) {
+            std::fill_n(&fluxBottom[rowStart], width, 0.0f);
+        }
+    }
+}
+
+void PipeErosion::updateWater(int firstRow, int lastRow) {
+    for (int y = firstRow; y < lastRow; y++) {
+        size_t rowStart = (size_t)(y + 1) * paddedWidth + 1;
+        waterRow(&terrain[rowStart], &fluxLeft[rowStart], &fluxRight[rowStart], &fluxTop[rowStart],
+                 &fluxBottom[rowStart], &water[rowStart], &velocityX[rowStart], &velocityY[rowStart],
+                 &capacity[rowStart], width, paddedWidth, timeStep, sedimentCapacityFactor, minTilt);
+    }
+}
+
+void PipeErosion::erodeAndDeposit(int firstRow, int lastRow) {
+    for (int y = firstRow; y < lastRow; y++) {
+        size_t rowStart = (size_t)(y + 1) * paddedWidth + 1;
+        erodeRow(&terrain[rowStart], &sediment[rowStart], &capacity[rowStart], &water[rowStart], width,
+                 erodeSpeed * timeStep, depositSpeed * timeStep, maxErosionRate * timeStep, 1 / maxErosionDepth);
+        padRow(terrain, y);
+    }
+}
+
+void PipeErosion::relaxSlopes(int firstRow, int lastRow) {
+    float talus = talusSlope / std::max(width, height);
+    // More than a quarter of the excess per step could overshoot, a cell evens out with four neighbors at once
+    float rate = std::min(0.25f, talusRate * timeStep);
+    for (int y = firstRow; y < lastRow; y++) {
+        size_t rowStart = (size_t)(y + 1) * paddedWidth + 1;
+        relaxRow(&terrain[rowStart], &terrainNext[rowStart], width, paddedWidth, talus, rate);
+        padRow(terrainNext, y);
+    }
+}
+
+void PipeErosion::transportSediment(int firstRow, int lastRow) {
+    float keep = 1 - evaporateSpeed * timeStep;
+    float rain = rainRate * timeStep;
+    for (int y = firstRow; y < lastRow; y++) {
+        size_t rowStart = (size_t)(y + 1) * paddedWidth + 1;
+        transportRow(sediment.data(), &velocityX[rowStart], &velocityY[rowStart], &sedimentNext[rowStart],
+                     &water[rowStart], width, height, y, paddedWidth, timeStep, keep, rain);
+    }
+}
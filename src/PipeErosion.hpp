@@ -0,0 +1,94 @@
+#ifndef PIPEEROSION_HPP
+#define PIPEEROSION_HPP
+
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Heightmap.hpp"
+#include "ThreadPool.hpp"
+
+// Grid based erosion with the virtual pipe model: every cell holds water and suspended sediment and
+// exchanges water with its four neighbors through pipes. A step is a few passes over the whole map that
+// only write the cell they visit, so rows split over threads and the loops vectorize.
+// No water flows through the edges of the map, it leaves by evaporating. Lengths are in cells, heights in map units
+class PipeErosion {
+public:
+    // Simulated time per step, larger steps are faster but get unstable on steep terrain
+    float timeStep = 0.05f;
+    // Water added to every cell per unit of time
+    float rainRate = 0.001f;
+    float gravity = 4;
+    // Fraction of the flow through a pipe lost per unit of time. Without it water sloshing around in pits
+    // never settles and keeps digging them deeper
+    float friction = 0.5f;
+    // Sediment the water of a cell can carry is sedimentCapacityFactor * tilt * speed * depth,
+    // tilt being the sine of the terrain slope and at least minTilt
+    float sedimentCapacityFactor = 4;
+    float minTilt = 0.01f;
+    float erodeSpeed = 0.3f;
+    float depositSpeed = 0.3f;
+    // Fraction of the water evaporating per unit of time
+    float evaporateSpeed = 0.1f;
+    // Water erodes less the deeper it is and not at all from this depth on, pooled water settles instead of
+    // digging its pit deeper
+    float maxErosionDepth = 0.05f;
+    // Most terrain a cell loses to or gains from the water per unit of time
+    float maxErosionRate = 0.01f;
+    // Neighboring cells further apart in height than talusSlope / the longer side of the map slide towards
+    // each other, removing the excess at talusRate per unit of time. Relative to the map size so the same
+    // landscape keeps its shape at any resolution
+    float talusSlope = 16;
+    float talusRate = 2;
+
+    int numThreads = 1;
+
+    // Runs numSteps steps on a row-major map in place. Water, sediment and flow carry over to the next call
+    // on a map of the same size unless reset is set. False if the map is smaller than 2 x 2 cells or the
+    // stride is less than the width
+    bool erode(const HeightmapView &map, int numSteps = 1, bool reset = false);
+    // Drops the sediment still suspended in the water onto the map and clears it
+    void settle(const HeightmapView &map);
+
+    // Water and suspended sediment summed over the map
+    double totalWater() const;
+    double totalSediment() const;
+
+private:
+    int width = 0;
+    int height = 0;
+
+    // Grids are padded by one cell on every side, cell (x, y) is at (y + 1) * paddedWidth + x + 1.
+    // Padding cells hold the terrain of the edge cell next to them and never any water or flow
+    int paddedWidth = 0;
+    std::vector<float> terrain;
+    std::vector<float> terrainNext;
+    std::vector<float> water;
+    std::vector<float> sediment;
+    std::vector<float> sedimentNext;
+    // Outflow through the pipe to each neighbor
+    std::vector<float> fluxLeft;
+    std::vector<float> fluxRight;
+    std::vector<float> fluxTop;
+    std::vector<float> fluxBottom;
+    std::vector<float> velocityX;
+    std::vector<float> velocityY;
+    std::vector<float> capacity;
+
+    std::unique_ptr<ThreadPool> threadPool;
+
+    void reset(int mapWidth, int mapHeight);
+    // Calls pass(firstRow, lastRow) for bands of rows covering the map on every thread
+    void forEachBand(const std::function<void(int, int)> &pass);
+    void padRow(std::vector<float> &grid, int y);
+
+    // The passes of a step, each depends on every cell of the one before
+    void updateFlux(int firstRow, int lastRow);
+    void updateWater(int firstRow, int lastRow);
+    void erodeAndDeposit(int firstRow, int lastRow);
+    void relaxSlopes(int firstRow, int lastRow);
+    void transportSediment(int firstRow, int lastRow);
+};
+
+
+#endif
@@ -0,0 +1,334 @@
+#include "ShardedErosion.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// What one shard sends its neighbour across their boundary after every epoch
+struct ShardChannel {
+    // Change the sender made to its halo of the receiver's rows during the epoch
+    float* deltas;
+    // The sender's rows along the boundary, once the receiver's deltas are in, to refresh the receiver's halo
+    float* values;
+    // Droplets that flowed across the boundary
+    int* count;
+    DropletState* droplets;
+};
+
+// Written by every shard, read by the others between epochs and by the caller at the end
+struct ShardResult {
+    // Droplets that didn't fit into a full channel and wait for the next epoch
+    int waiting;
+    long long simulatedSteps;
+    ErosionStats stats;
+};
+
+// Shared memory of a sharded run: a barrier, the results, the channels and the eroded map
+class SharedRun {
+public:
+    pthread_barrier_t* barrier = nullptr;
+    ShardResult* results = nullptr;
+    // down[b] runs from shard b to shard b + 1, up[b] the other way
+    std::vector<ShardChannel> down;
+    std::vector<ShardChannel> up;
+    float* map = nullptr;
+
+    ~SharedRun() {
+        if (base) {
+            pthread_barrier_destroy(barrier);
+            munmap(base, size);
+        }
+    }
+
+    bool create(int numShards, int halo, int width, int height, int mailboxCapacity) {
+        auto align = [](size_t bytes) { return (bytes + 63) & ~(size_t)63; };
+        size_t haloBytes = align((size_t)halo * width * sizeof(float));
+        size_t mailboxBytes = align(sizeof(int)) + align((size_t)mailboxCapacity * sizeof(DropletState));
+        size_t channelBytes = 2 * haloBytes + mailboxBytes;
+        size_t numBoundaries = numShards - 1;
+        size = align(sizeof(pthread_barrier_t)) + align(numShards * sizeof(ShardResult)) +
+               2 * numBoundaries * channelBytes + (size_t)width * height * sizeof(float);
+
+        static std::atomic<int> runs;
+        std::string name = "/hydraulic-erosion-" + std::to_string(getpid()) + "-" + std::to_string(runs++);
+        int handle = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (handle < 0) {
+            return false;
+        }
+        void* address = ftruncate(handle, size) == 0
+                        ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0) : MAP_FAILED;
+        // Only workers forked from here map it, so the name can go right away and nothing is left behind
+        shm_unlink(name.c_str());
+        close(handle);
+        if (address == MAP_FAILED) {
+            return false;
+        }
+
+        char* next = (char*)address;
+        auto take = [&](size_t bytes) {
+            char* part = next;
+            next += align(bytes);
+            return part;
+        };
+        barrier = (pthread_barrier_t*)take(sizeof(pthread_barrier_t));
+        results = (ShardResult*)take(numShards * sizeof(ShardResult));
+        for (std::vector<ShardChannel>* channels : {&down, &up}) {
+            for (size_t boundary = 0; boundary < numBoundaries; boundary++) {
+                ShardChannel channel;
+                channel.deltas = (float*)take(haloBytes);
+                channel.values = (float*)take(haloBytes);
+                channel.count = (int*)take(sizeof(int));
+                channel.droplets = (DropletState*)take((size_t)mailboxCapacity * sizeof(DropletState));
+                channels->push_back(channel);
+            }
+        }
+        map = (float*)take((size_t)width * height * sizeof(float));
+
+        pthread_barrierattr_t attributes;
+        pthread_barrierattr_init(&attributes);
+        pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        bool initialized = pthread_barrier_init(barrier, &attributes, numShards) == 0;
+        pthread_barrierattr_destroy(&attributes);
+        if (!initialized) {
+            munmap(address, size);
+            return false;
+        }
+        base = address;
+        return true;
+    }
+
+private:
+    void* base = nullptr;
+    size_t size = 0;
+};
+
+// Runs in the worker process of one shard, which owns rows [bandStart[shard], bandStart[shard + 1])
+static void runShard(Erosion &eroder, const HeightmapView &map, int shard, const std::vector<int> &bandStart,
+                     int halo, int numIterations, const ShardOptions &options, SharedRun &run) {
+    int firstRow = bandStart[shard];
+    int endRow = bandStart[shard + 1];
+    bool hasUpper = shard > 0;
+    bool hasLower = shard < options.numShards - 1;
+    size_t haloCells = (size_t)halo * map.width;
+
+    auto readRows = [&](int y, float* out) {
+        for (int row = 0; row < halo; row++) {
+            std::copy_n(map.data + (size_t)(y + row) * map.stride, map.width, out + (size_t)row * map.width);
+        }
+    };
+    auto writeRows = [&](int y, const float* values, bool add) {
+        for (int row = 0; row < halo; row++) {
+            float* cells = map.data + (size_t)(y + row) * map.stride;
+            const float* rowValues = values + (size_t)row * map.width;
+            for (int x = 0; x < map.width; x++) {
+                cells[x] = add ? cells[x] + rowValues[x] : rowValues[x];
+            }
+        }
+    };
+
+    // Halo rows as last received, what the shard changed in them is the difference to these
+    std::vector<float> upperHalo(hasUpper ? haloCells : 0);
+    std::vector<float> lowerHalo(hasLower ? haloCells : 0);
+    if (hasUpper) {
+        readRows(firstRow - halo, upperHalo.data());
+    }
+    if (hasLower) {
+        readRows(endRow, lowerHalo.data());
+    }
+
+    auto send = [&](ShardChannel &channel, std::vector<DropletState> &waiting, int haloRow,
+                    const std::vector<float> &received) {
+        int sent = std::min((int)waiting.size(), options.mailboxCapacity);
+        std::copy_n(waiting.begin(), sent, channel.droplets);
+        *channel.count = sent;
+        waiting.erase(waiting.begin(), waiting.begin() + sent);
+        readRows(haloRow, channel.deltas);
+        for (size_t i = 0; i < haloCells; i++) {
+            channel.deltas[i] -= received[i];
+        }
+    };
+    auto receive = [&](const ShardChannel &channel, int row, std::vector<DropletState> &arriving) {
+        writeRows(row, channel.deltas, true);
+        arriving.insert(arriving.end(), channel.droplets, channel.droplets + *channel.count);
+    };
+
+    std::vector<DropletState> arriving;
+    std::vector<DropletState> leaving;
+    std::vector<DropletState> waitingUp;
+    std::vector<DropletState> waitingDown;
+    ShardResult &result = run.results[shard];
+    result.simulatedSteps = 0;
+    result.stats.reset();
+    for (int epoch = 0;; epoch++) {
+        int count = epoch < options.epochs ? (int)((long long)numIterations * (epoch + 1) / options.epochs -
+                                                   (long long)numIterations * epoch / options.epochs) : 0;
+        leaving.clear();
+        eroder.erodeRows(map, firstRow, endRow, arriving, leaving, count);
+        result.simulatedSteps += eroder.simulatedSteps;
+        if (eroder.collectStats) {
+            result.stats.merge(eroder.stats);
+        }
+        for (const DropletState &droplet : leaving) {
+            ((int)droplet.posY < firstRow ? waitingUp : waitingDown).push_back(droplet);
+        }
+
+        if (hasUpper) {
+            send(run.up[shard - 1], waitingUp, firstRow - halo, upperHalo);
+        }
+        if (hasLower) {
+            send(run.down[shard], waitingDown, endRow, lowerHalo);
+        }
+        result.waiting = (int)(waitingUp.size() + waitingDown.size());
+        pthread_barrier_wait(run.barrier);
+
+        // Every shard sees the same counts here, so they all stop after the same epoch
+        bool done = epoch + 1 >= options.epochs;
+        for (int boundary = 0; boundary < options.numShards - 1; boundary++) {
+            done = done && *run.down[boundary].count == 0 && *run.up[boundary].count == 0;
+        }
+        for (int other = 0; other < options.numShards; other++) {
+            done = done && run.results[other].waiting == 0;
+        }
+
+        arriving.clear();
+        if (hasUpper) {
+            receive(run.down[shard - 1], firstRow, arriving);
+        }
+        if (hasLower) {
+            receive(run.up[shard], endRow - halo, arriving);
+        }
+        if (done) {
+            break;
+        }
+        if (hasUpper) {
+            readRows(firstRow, run.up[shard - 1].values);
+        }
+        if (hasLower) {
+            readRows(endRow - halo, run.down[shard].values);
+        }
+        pthread_barrier_wait(run.barrier);
+
+        if (hasUpper) {
+            std::copy_n(run.down[shard - 1].values, haloCells, upperHalo.data());
+            writeRows(firstRow - halo, upperHalo.data(), false);
+        }
+        if (hasLower) {
+            std::copy_n(run.up[shard].values, haloCells, lowerHalo.data());
+            writeRows(endRow, lowerHalo.data(), false);
+        }
+    }
+
+    for (int y = firstRow; y < endRow; y++) {
+        std::copy_n(map.data + (size_t)y * map.stride, map.width, run.map + (size_t)y * map.width);
+    }
+}
+
+bool erodeSharded(Erosion &eroder, const HeightmapView &map, int numIterations, bool resetSeed,
+                  const ShardOptions &options, std::string &error) {
+    using Clock = std::chrono::steady_clock;
+    if (!map.data || map.width < 2 || map.height < 2 || map.stride < map.width || options.numShards < 1 ||
+        options.epochs < 1 || options.mailboxCapacity < 1) {
+        error = "Invalid map or shard options";
+        return false;
+    }
+    // Droplets read and write at most erosionRadius + 1 rows outside their band
+    int halo = eroder.erosionRadius + 1;
+    std::vector<int> bandStart(options.numShards + 1);
+    for (int shard = 0; shard <= options.numShards; shard++) {
+        bandStart[shard] = (int)((long long)map.height * shard / options.numShards);
+        if (shard > 0 && options.numShards > 1 && bandStart[shard] - bandStart[shard - 1] < halo) {
+            error = "A map of " + std::to_string(map.height) + " rows can't be split into " +
+                    std::to_string(options.numShards) + " bands of at least " + std::to_string(halo) + " rows";
+            return false;
+        }
+    }
+
+    // Seeds the eroder and builds the brush before forking, every worker inherits both
+    std::vector<DropletState> noDroplets;
+    std::vector<DropletState> leaving;
+    eroder.erodeRows(map, 0, 0, noDroplets, leaving, 0, resetSeed);
+    long long firstDroplet = eroder.dropletCursor;
+
+    SharedRun run;
+    if (!run.create(options.numShards, halo, map.width, map.height, options.mailboxCapacity)) {
+        error = "Could not set up shared memory for " + std::to_string(options.numShards) + " shards";
+        return false;
+    }
+
+    Clock::time_point start = Clock::now();
+    std::vector<pid_t> workers;
+    bool failed = false;
+    for (int shard = 0; shard < options.numShards && !failed; shard++) {
+        pid_t worker = fork();
+        if (worker == 0) {
+            bool finished = false;
+            try {
+                runShard(eroder, map, shard, bandStart, halo, numIterations, options, run);
+                finished = true;
+            } catch (...) {
+            }
+            // Leaves the caller's buffers and exit handlers alone
+            _exit(finished ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (worker < 0) {
+            failed = true;
+        } else {
+            workers.push_back(worker);
+        }
+    }
+
+    // A worker that fails leaves the others waiting at the barrier for ever, so they are stopped
+    std::vector<bool> running(workers.size(), true);
+    size_t numRunning = workers.size();
+    while (numRunning > 0) {
+        bool reaped = false;
+        for (size_t i = 0; i < workers.size(); i++) {
+            int status = 0;
+            if (!running[i] || waitpid(workers[i], &status, WNOHANG) == 0) {
+                continue;
+            }
+            running[i] = false;
+            numRunning--;
+            reaped = true;
+            failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+        }
+        for (size_t i = 0; i < workers.size() && failed; i++) {
+            if (running[i]) {
+                kill(workers[i], SIGKILL);
+            }
+        }
+        if (!reaped) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if (failed) {
+        error = "A shard worker failed";
+        return false;
+    }
+
+    for (int y = 0; y < map.height; y++) {
+        std::copy_n(run.map + (size_t)y * map.width, map.width, map.data + (size_t)y * map.stride);
+    }
+    eroder.resumeAt(firstDroplet + numIterations);
+    eroder.simulatedSteps = 0;
+    if (eroder.collectStats) {
+        eroder.stats.reset();
+    }
+    for (int shard = 0; shard < options.numShards; shard++) {
+        eroder.simulatedSteps += run.results[shard].simulatedSteps;
+        if (eroder.collectStats) {
+            eroder.stats.merge(run.results[shard].stats);
+        }
+    }
+    if (eroder.collectStats) {
+        eroder.stats.simulationSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return true;
+}
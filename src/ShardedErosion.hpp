@@ -0,0 +1,31 @@
+#ifndef SHARDEDEROSION_HPP
+#define SHARDEDEROSION_HPP
+
+
+#include <string>
+#include "Erosion.hpp"
+
+struct ShardOptions {
+    // Worker processes, each owning a band of rows at least erosionRadius + 1 rows high
+    int numShards = 2;
+    // The droplets are spread evenly over this many epochs. Within an epoch a shard sees the rows of its neighbours
+    // as they were when it started, more epochs keep that closer to a single process run
+    int epochs = 16;
+    // Droplets handed across one boundary in one direction per epoch, the rest wait for the next epoch
+    int mailboxCapacity = 1 << 16;
+};
+
+// Erodes a row-major map with worker processes forked for the call, splitting it into bands of rows.
+// Each worker erodes its copy-on-write copy of the map and only ever touches its band plus a halo of
+// erosionRadius + 1 rows on either side. Between epochs neighbours exchange, through POSIX shared memory,
+// what they changed in each other's rows and the droplets that flowed across their boundary, which carry on
+// where they left off. Nothing else is shared, so the workers could as well run on different machines.
+// The result only depends on the seed, the droplets, numShards and epochs, and with one shard it's the
+// sequential scalar one. Droplets carry on from the eroder's cursor, resetSeed resets it first. With
+// collectStats the eroder's stats cover every shard. Has to be called while the process runs no other threads.
+// False with error set if the map can't be split into numShards bands or a worker failed
+bool erodeSharded(Erosion &eroder, const HeightmapView &map, int numIterations, bool resetSeed,
+                  const ShardOptions &options, std::string &error);
+
+
+#endif
@@ -0,0 +1,230 @@
+#include "SnapshotRing.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char snapshotMagic[8] = {'H', 'E', 'S', 'N', 'A', 'P', '1', '\0'};
+
+struct SnapshotHeader {
+    char magic[8];
+    int32_t mapSize;
+    int32_t frameSize;
+    int32_t numSlots;
+    uint64_t slotBytes;
+    // Process publishing the frames, readers stop waiting for more once it's gone
+    int32_t publisher;
+    // Slot of the newest frame, -1 before the first
+    std::atomic<int32_t> latest;
+    std::atomic<int32_t> done;
+};
+
+struct SnapshotSlot {
+    // Odd while the publisher writes the slot, a reader whose copy started and ended on the same even value
+    // copied one whole frame
+    std::atomic<uint64_t> sequence;
+    long long frame;
+    long long droplets;
+    long long totalDroplets;
+
+    // frameSize x frameSize heights follow the slot
+    float* heights() { return (float*)(this + 1); }
+    const float* heights() const { return (const float*)(this + 1); }
+};
+
+// Shared between processes, so the counters can't fall back to locks inside the process
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free);
+
+static size_t alignSlot(size_t bytes) {
+    return (bytes + 63) & ~(size_t)63;
+}
+
+SnapshotPublisher::~SnapshotPublisher() {
+    if (base) {
+        finish();
+        munmap(base, mappingSize);
+        shm_unlink(sharedName.c_str());
+    }
+}
+
+bool SnapshotPublisher::create(const std::string &name, int mapSize, int frameSize, int numSlots) {
+    if (base || name.empty() || name.find('/') != std::string::npos || mapSize < 1 || numSlots < 2) {
+        return false;
+    }
+    factor = frameSize > 0 ? (mapSize + frameSize - 1) / frameSize : 1;
+    size = (mapSize + factor - 1) / factor;
+
+    sharedName = "/" + name;
+    shm_unlink(sharedName.c_str());
+    int handle = shm_open(sharedName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (handle < 0) {
+        return false;
+    }
+    size_t slotBytes = alignSlot(sizeof(SnapshotSlot) + (size_t)size * size * sizeof(float));
+    mappingSize = alignSlot(sizeof(SnapshotHeader)) + numSlots * slotBytes;
+    void* address = ftruncate(handle, mappingSize) == 0
+                    ? mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0) : MAP_FAILED;
+    close(handle);
+    if (address == MAP_FAILED) {
+        shm_unlink(sharedName.c_str());
+        return false;
+    }
+
+    base = address;
+    header = (SnapshotHeader*)address;
+    header->mapSize = mapSize;
+    header->frameSize = size;
+    header->numSlots = numSlots;
+    header->slotBytes = slotBytes;
+    header->publisher = (int32_t)getpid();
+    header->latest.store(-1, std::memory_order_relaxed);
+    header->done.store(0, std::memory_order_relaxed);
+    // Readers only trust the header once the magic is there
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, snapshotMagic, sizeof(snapshotMagic));
+    band.resize(factor > 1 ? (size_t)factor * mapSize : 0);
+    return true;
+}
+
+SnapshotSlot* SnapshotPublisher::slot(int index) const {
+    return (SnapshotSlot*)((char*)base + alignSlot(sizeof(SnapshotHeader)) + index * header->slotBytes);
+}
+
+void SnapshotPublisher::publish(const Heightmap &map, long long droplets, long long totalDroplets) {
+    if (!header || map.size() != header->mapSize) {
+        return;
+    }
+    int index = (int)(published % header->numSlots);
+    SnapshotSlot* target = slot(index);
+    uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+    target->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    target->frame = published;
+    target->droplets = droplets;
+    target->totalDroplets = totalDroplets;
+    float* heights = target->heights();
+    int mapSize = map.size();
+    if (factor == 1) {
+        map.read(0, 0, mapSize, mapSize, heights, mapSize);
+    } else {
+        // Each frame cell is the mean of the map cells it covers, the last row and column may cover fewer
+        for (int frameY = 0; frameY < size; frameY++) {
+            int y = frameY * factor;
+            int rows = std::min(factor, mapSize - y);
+            map.read(0, y, mapSize, rows, band.data(), mapSize);
+            for (int frameX = 0; frameX < size; frameX++) {
+                int x = frameX * factor;
+                int columns = std::min(factor, mapSize - x);
+                float sum = 0;
+                for (int row = 0; row < rows; row++) {
+                    const float* cells = band.data() + (size_t)row * mapSize + x;
+                    for (int column = 0; column < columns; column++) {
+                        sum += cells[column];
+                    }
+                }
+                heights[(size_t)frameY * size + frameX] = sum / (rows * columns);
+            }
+        }
+    }
+
+    target->sequence.store(sequence + 2, std::memory_order_release);
+    header->latest.store(index, std::memory_order_release);
+    published++;
+}
+
+void SnapshotPublisher::finish() {
+    if (header) {
+        header->done.store(1, std::memory_order_release);
+    }
+}
+
+SnapshotReader::~SnapshotReader() {
+    close();
+}
+
+bool SnapshotReader::open(const std::string &name) {
+    close();
+    int handle = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+    if (handle < 0) {
+        return false;
+    }
+    struct stat status;
+    bool sized = fstat(handle, &status) == 0 && (size_t)status.st_size >= alignSlot(sizeof(SnapshotHeader));
+    void* address = sized ? mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, handle, 0) : MAP_FAILED;
+    ::close(handle);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    SnapshotHeader* candidate = (SnapshotHeader*)address;
+    bool valid = std::memcmp(candidate->magic, snapshotMagic, sizeof(snapshotMagic)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    valid = valid && candidate->frameSize > 0 && candidate->numSlots > 0 &&
+            sizeof(SnapshotSlot) + (size_t)candidate->frameSize * candidate->frameSize * sizeof(float) <=
+            candidate->slotBytes &&
+            alignSlot(sizeof(SnapshotHeader)) + candidate->numSlots * candidate->slotBytes <= (size_t)status.st_size;
+    if (!valid) {
+        munmap(address, status.st_size);
+        return false;
+    }
+    base = address;
+    mappingSize = status.st_size;
+    header = candidate;
+    return true;
+}
+
+void SnapshotReader::close() {
+    if (base) {
+        munmap(base, mappingSize);
+        base = nullptr;
+        header = nullptr;
+    }
+}
+
+SnapshotSlot* SnapshotReader::slot(int index) const {
+    return (SnapshotSlot*)((char*)base + alignSlot(sizeof(SnapshotHeader)) + index * header->slotBytes);
+}
+
+bool SnapshotReader::read(SnapshotFrame &frame) const {
+    if (!header) {
+        return false;
+    }
+    size_t cells = (size_t)header->frameSize * header->frameSize;
+    for (int attempt = 0; attempt < 8; attempt++) {
+        int index = header->latest.load(std::memory_order_acquire);
+        if (index < 0 || index >= header->numSlots) {
+            return false;
+        }
+        const SnapshotSlot* source = slot(index);
+        uint64_t sequence = source->sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            continue;
+        }
+        frame.frame = source->frame;
+        frame.droplets = source->droplets;
+        frame.totalDroplets = source->totalDroplets;
+        frame.size = header->frameSize;
+        frame.heights.assign(source->heights(), source->heights() + cells);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (source->sequence.load(std::memory_order_relaxed) == sequence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SnapshotReader::finished() const {
+    return header && header->done.load(std::memory_order_acquire) != 0;
+}
+
+bool SnapshotReader::publisherGone() const {
+    // EPERM means the process exists but belongs to someone else
+    return header && !finished() && kill(header->publisher, 0) != 0 && errno == ESRCH;
+}
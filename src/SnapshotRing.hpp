@@ -0,0 +1,91 @@
+#ifndef SNAPSHOTRING_HPP
+#define SNAPSHOTRING_HPP
+
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Heightmap.hpp"
+
+struct SnapshotHeader;
+struct SnapshotSlot;
+
+// Frames of a running erosion in a ring of slots in named POSIX shared memory. The publisher writes each frame
+// into the slot after the newest one and then points readers at it, readers copy the newest slot and retry if
+// the publisher came round to it meanwhile. Neither side ever waits for the other
+
+// One frame as a reader copied it
+struct SnapshotFrame {
+    // Frames published before this one
+    long long frame = 0;
+    // Droplets simulated when it was taken, out of the whole run
+    long long droplets = 0;
+    long long totalDroplets = 0;
+    // Cells across the frame, row-major heights
+    int size = 0;
+    std::vector<float> heights;
+};
+
+class SnapshotPublisher {
+public:
+    SnapshotPublisher() = default;
+    // Finishes the ring and removes its name
+    ~SnapshotPublisher();
+
+    SnapshotPublisher(const SnapshotPublisher&) = delete;
+    SnapshotPublisher& operator=(const SnapshotPublisher&) = delete;
+
+    // Creates the ring called name, replacing one a crashed run left behind. Frames of a map of mapSize cells are
+    // box filtered down to at most frameSize cells across, 0 keeps the full map. False if it can't be created
+    bool create(const std::string &name, int mapSize, int frameSize = 1024, int numSlots = 3);
+    int frameSize() const { return size; }
+
+    // Writes map, filtered straight into the next slot, and makes it the newest frame
+    void publish(const Heightmap &map, long long droplets, long long totalDroplets);
+    // Tells readers no more frames follow
+    void finish();
+
+private:
+    std::string sharedName;
+    void* base = nullptr;
+    size_t mappingSize = 0;
+    SnapshotHeader* header = nullptr;
+    int size = 0;
+    // Map cells averaged into one frame cell along each side
+    int factor = 1;
+    long long published = 0;
+    // Rows of the map that make up one frame row
+    std::vector<float> band;
+
+    SnapshotSlot* slot(int index) const;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader() = default;
+    ~SnapshotReader();
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    // False while no ring of that name exists
+    bool open(const std::string &name);
+    void close();
+
+    // Copies the newest frame. False before the first frame or if the publisher kept overwriting it
+    bool read(SnapshotFrame &frame) const;
+    // Whether the publisher is done, frames read after this returned true include the last one
+    bool finished() const;
+    // Whether the publishing process exited without finishing, no more frames will come
+    bool publisherGone() const;
+
+private:
+    void* base = nullptr;
+    size_t mappingSize = 0;
+    SnapshotHeader* header = nullptr;
+
+    SnapshotSlot* slot(int index) const;
+};
+
+
+#endif
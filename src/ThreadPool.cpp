@@ -0,0 +1,75 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(int numThreads) {
+    for (int i = 1; i < numThreads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeWorkers.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& task) {
+    if (count <= 0) {
+        return;
+    }
+    if (workers.empty() || count == 1) {
+        for (int i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &task;
+        jobCount = count;
+        nextIndex = 0;
+        busyWorkers = (int)workers.size();
+        generation++;
+    }
+    wakeWorkers.notify_all();
+
+    runJob();
+
+    // Every worker has to check in before the task can go out of scope
+    std::unique_lock<std::mutex> lock(mutex);
+    jobFinished.wait(lock, [this] { return busyWorkers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop() {
+    unsigned seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeWorkers.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        runJob();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0) {
+            jobFinished.notify_one();
+        }
+    }
+}
+
+void ThreadPool::runJob() {
+    // Indices are handed out one at a time so uneven tasks still balance out
+    for (int i = nextIndex++; i < jobCount; i = nextIndex++) {
+        (*job)(i);
+    }
+}
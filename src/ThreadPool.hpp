@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run index ranges in parallel.
+// The calling thread takes part in the work, so a pool of size 1 spawns no workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)workers.size() + 1; }
+
+    // Calls task(i) for every i in [0, count) and returns once all of them have finished
+    void parallelFor(int count, const std::function<void(int)>& task);
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeWorkers;
+    std::condition_variable jobFinished;
+
+    const std::function<void(int)>* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextIndex = 0;
+    int busyWorkers = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+
+    void workerLoop();
+    void runJob();
+};
+
+
+#endif
@@ -0,0 +1,173 @@
+#include "TiffWriter.hpp"
+#include "ThreadPool.hpp"
+#include <tiffio.h>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#ifdef HYDRAULIC_EROSION_ZLIB
+#include <zlib.h>
+#endif
+
+bool parseTiffCompression(const std::string& name, TiffCompression& compression) {
+    if (name == "none") {
+        compression = TiffCompression::None;
+    } else if (name == "deflate") {
+        compression = TiffCompression::Deflate;
+    } else if (name == "lzw") {
+        compression = TiffCompression::Lzw;
+    } else if (name == "zstd") {
+        compression = TiffCompression::Zstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static uint16_t compressionTag(TiffCompression compression) {
+    switch (compression) {
+        case TiffCompression::Deflate: return COMPRESSION_ADOBE_DEFLATE;
+        case TiffCompression::Lzw: return COMPRESSION_LZW;
+        case TiffCompression::Zstd: return COMPRESSION_ZSTD;
+        default: return COMPRESSION_NONE;
+    }
+}
+
+bool tiffCompressionAvailable(TiffCompression compression) {
+    return TIFFIsCODECConfigured(compressionTag(compression));
+}
+
+// Same as libtiff's PREDICTOR_HORIZONTAL for 16 bit samples
+static void horizontalDifference(uint16_t* row, int width) {
+    for (int x = width - 1; x > 0; x--) {
+        row[x] -= row[x - 1];
+    }
+}
+
+// Same as libtiff's PREDICTOR_FLOATINGPOINT: the row is split into byte planes, most significant first,
+// then every byte is differenced with the one before it
+static void floatingPointDifference(unsigned char* row, int width, unsigned char* scratch) {
+    std::memcpy(scratch, row, (size_t)width * 4);
+    for (int x = 0; x < width; x++) {
+        for (int byte = 0; byte < 4; byte++) {
+            int plane = std::endian::native == std::endian::little ? 3 - byte : byte;
+            row[plane * width + x] = scratch[x * 4 + byte];
+        }
+    }
+    for (int i = width * 4 - 1; i > 0; i--) {
+        row[i] -= row[i - 1];
+    }
+}
+
+// Buffers of one tile in flight, reused from batch to batch
+struct TileBuffers {
+    std::vector<float> heights;
+    std::vector<uint16_t> quantized;
+    std::vector<unsigned char> scratch;
+    std::vector<unsigned char> compressed;
+    size_t compressedSize = 0;
+};
+
+bool writeTiledImage(const char* name, int size, const MapRegionReader& readRegion, const TiffOptions& options) {
+    // TIFF wants tile dimensions in multiples of 16
+    int tileSize = std::max(16, (options.tileSize + 15) / 16 * 16);
+    int tilesPerSide = (size + tileSize - 1) / tileSize;
+    int numTiles = tilesPerSide * tilesPerSide;
+    bool floats = options.format == TiffSampleFormat::Float32;
+    size_t tileSamples = (size_t)tileSize * tileSize;
+    size_t tileBytes = tileSamples * (floats ? sizeof(float) : sizeof(uint16_t));
+    bool compressed = options.compression != TiffCompression::None;
+
+#ifdef HYDRAULIC_EROSION_ZLIB
+    // Deflate is done here so every thread can compress, libtiff's codecs belong to the single TIFF handle
+    bool encodeHere = options.compression == TiffCompression::Deflate;
+#else
+    bool encodeHere = false;
+#endif
+
+    // Classic TIFF uses 32 bit offsets, switch to BigTIFF when even the uncompressed tiles might not fit
+    bool bigTiff = (uint64_t)numTiles * tileBytes > 0xF0000000ull;
+    TIFF* tif = TIFFOpen(name, bigTiff ? "w8" : "w");
+    if (!tif) {
+        return false;
+    }
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, size);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, size);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, floats ? 32 : 16);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, floats ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT);
+    TIFFSetField(tif, TIFFTAG_TILEWIDTH, tileSize);
+    TIFFSetField(tif, TIFFTAG_TILELENGTH, tileSize);
+    TIFFSetField(tif, TIFFTAG_ORIENTATION, (int)ORIENTATION_TOPLEFT);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, compressionTag(options.compression));
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    if (compressed) {
+        TIFFSetField(tif, TIFFTAG_PREDICTOR, floats ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL);
+    }
+
+    ThreadPool pool(options.numThreads);
+    int batchSize = std::min(numTiles, pool.size() * 4);
+    std::vector<TileBuffers> batch(batchSize);
+
+    auto prepareTile = [&](TileBuffers& buffers, int index) {
+        int tileX = index % tilesPerSide * tileSize;
+        int tileY = index / tilesPerSide * tileSize;
+        // Edge tiles are padded with zeros
+        buffers.heights.assign(tileSamples, 0.0f);
+        readRegion(tileX, tileY, std::min(tileSize, size - tileX), std::min(tileSize, size - tileY),
+                   buffers.heights.data(), tileSize);
+        if (!floats) {
+            // libtiff needs it to be in uint16_t since we're saving in 16 bits
+            buffers.quantized.resize(tileSamples);
+            for (size_t s = 0; s < tileSamples; s++) {
+                // Out of range heights would wrap around, NaN ends up at 0 too
+                float height = buffers.heights[s];
+                buffers.quantized[s] = (height > 0 ? std::min(height, 1.0f) : 0.0f) * __UINT16_MAX__;
+            }
+        }
+        if (!encodeHere) {
+            return;
+        }
+
+#ifdef HYDRAULIC_EROSION_ZLIB
+        unsigned char* samples = floats ? (unsigned char*)buffers.heights.data() : (unsigned char*)buffers.quantized.data();
+        buffers.scratch.resize((size_t)tileSize * 4);
+        for (int row = 0; row < tileSize; row++) {
+            if (floats) {
+                floatingPointDifference(samples + (size_t)row * tileSize * 4, tileSize, buffers.scratch.data());
+            } else {
+                horizontalDifference(buffers.quantized.data() + (size_t)row * tileSize, tileSize);
+            }
+        }
+        uLongf compressedSize = compressBound(tileBytes);
+        buffers.compressed.resize(compressedSize);
+        if (compress2(buffers.compressed.data(), &compressedSize, samples, tileBytes, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            compressedSize = 0;
+        }
+        buffers.compressedSize = compressedSize;
+#endif
+    };
+
+    bool success = true;
+    for (int first = 0; first < numTiles && success; first += batchSize) {
+        int count = std::min(batchSize, numTiles - first);
+        pool.parallelFor(count, [&](int i) { prepareTile(batch[i], first + i); });
+
+        for (int i = 0; i < count && success; i++) {
+            TileBuffers& buffers = batch[i];
+            void* samples = floats ? (void*)buffers.heights.data() : (void*)buffers.quantized.data();
+            if (encodeHere) {
+                success = buffers.compressedSize > 0 &&
+                          TIFFWriteRawTile(tif, first + i, buffers.compressed.data(), buffers.compressedSize) >= 0;
+            } else {
+                success = TIFFWriteEncodedTile(tif, first + i, samples, tileBytes) >= 0;
+            }
+        }
+    }
+
+    success = success && TIFFWriteDirectory(tif);
+    TIFFClose(tif);
+    return success;
+}
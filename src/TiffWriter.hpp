@@ -0,0 +1,33 @@
+#ifndef TIFFWRITER_HPP
+#define TIFFWRITER_HPP
+
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+enum class TiffCompression {None, Deflate, Lzw, Zstd};
+
+enum class TiffSampleFormat {UInt16, Float32};
+
+struct TiffOptions {
+    TiffCompression compression = TiffCompression::None;
+    // UInt16 quantizes heights in [0, 1] to the full 16 bit range, Float32 keeps them as they are
+    TiffSampleFormat format = TiffSampleFormat::UInt16;
+    int tileSize = 256;
+    int numThreads = 1;
+};
+
+bool parseTiffCompression(const std::string& name, TiffCompression& compression);
+// Whether the linked libtiff can write this compression
+bool tiffCompressionAvailable(TiffCompression compression);
+
+// Copies a rectangle of the map to row-major memory with rows stride floats apart
+using MapRegionReader = std::function<void(int x, int y, int width, int height, float* out, size_t stride)>;
+
+// Writes a size x size map as a tiled TIFF. Tiles are read, converted and compressed in parallel
+// a batch at a time and written in order, so only a few tiles are ever held in memory
+bool writeTiledImage(const char* name, int size, const MapRegionReader& readRegion, const TiffOptions& options);
+
+
+#endif
@@ -0,0 +1,143 @@
+#include "TiledHeightmap.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// File layout: one page of header, then every tile as tileSize x tileSize floats in row-major tile order.
+// Tiles on the right and bottom edges are padded to full size
+static const char fileMagic[8] = {'H', 'E', 'T', 'I', 'L', 'E', 'S', '1'};
+static const size_t headerSize = 4096;
+
+struct TiledHeightmapHeader {
+    char magic[8];
+    int32_t size;
+    int32_t tileSize;
+};
+
+TiledHeightmap::~TiledHeightmap() {
+    close();
+}
+
+bool TiledHeightmap::create(const std::string& path, int size, int tileSize) {
+    close();
+    if (size <= 0 || tileSize <= 0) {
+        return false;
+    }
+    fileHandle = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fileHandle < 0) {
+        return false;
+    }
+    mapSize = size;
+    tileLength = tileSize;
+    return mapFile(true);
+}
+
+bool TiledHeightmap::open(const std::string& path) {
+    close();
+    fileHandle = ::open(path.c_str(), O_RDWR);
+    if (fileHandle < 0) {
+        return false;
+    }
+
+    TiledHeightmapHeader header;
+    if (pread(fileHandle, &header, sizeof(header), 0) != sizeof(header) ||
+        std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) != 0 || header.size <= 0 || header.tileSize <= 0) {
+        close();
+        return false;
+    }
+    mapSize = header.size;
+    tileLength = header.tileSize;
+    return mapFile(false);
+}
+
+bool TiledHeightmap::mapFile(bool writeHeader) {
+    size_t tileBytes = (size_t)tileLength * tileLength * sizeof(float);
+    mappingSize = headerSize + (size_t)tilesPerSide() * tilesPerSide() * tileBytes;
+
+    if (writeHeader && ftruncate(fileHandle, (off_t)mappingSize) != 0) {
+        close();
+        return false;
+    }
+
+    off_t fileSize = lseek(fileHandle, 0, SEEK_END);
+    if (fileSize < (off_t)mappingSize) {
+        close();
+        return false;
+    }
+
+    void* address = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileHandle, 0);
+    if (address == MAP_FAILED) {
+        close();
+        return false;
+    }
+    mapping = (unsigned char*)address;
+
+    if (writeHeader) {
+        TiledHeightmapHeader header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+        header.size = mapSize;
+        header.tileSize = tileLength;
+        std::memcpy(mapping, &header, sizeof(header));
+    }
+    return true;
+}
+
+void TiledHeightmap::close() {
+    if (mapping) {
+        munmap(mapping, mappingSize);
+        mapping = nullptr;
+    }
+    if (fileHandle >= 0) {
+        ::close(fileHandle);
+        fileHandle = -1;
+    }
+    mappingSize = 0;
+    mapSize = 0;
+    tileLength = 0;
+}
+
+float* TiledHeightmap::tile(int tileX, int tileY) const {
+    size_t tileIndex = (size_t)tileY * tilesPerSide() + tileX;
+    return (float*)(mapping + headerSize) + tileIndex * tileLength * tileLength;
+}
+
+void TiledHeightmap::read(int x, int y, int width, int height, float* out, size_t stride) const {
+    for (int row = y; row < y + height; row++) {
+        float* outRow = out + (row - y) * stride;
+        // Copy the run of every tile this row crosses
+        for (int column = x; column < x + width;) {
+            int tileX = column / tileLength;
+            int inTileX = column % tileLength;
+            int run = std::min(tileLength - inTileX, x + width - column);
+            const float* source = tile(tileX, row / tileLength) + (size_t)(row % tileLength) * tileLength + inTileX;
+            std::memcpy(outRow + (column - x), source, run * sizeof(float));
+            column += run;
+        }
+    }
+}
+
+void TiledHeightmap::write(int x, int y, int width, int height, const float* in, size_t stride) {
+    for (int row = y; row < y + height; row++) {
+        const float* inRow = in + (row - y) * stride;
+        for (int column = x; column < x + width;) {
+            int tileX = column / tileLength;
+            int inTileX = column % tileLength;
+            int run = std::min(tileLength - inTileX, x + width - column);
+            float* target = tile(tileX, row / tileLength) + (size_t)(row % tileLength) * tileLength + inTileX;
+            std::memcpy(target, inRow + (column - x), run * sizeof(float));
+            column += run;
+        }
+    }
+}
+
+void TiledHeightmap::release() {
+    if (!mapping) {
+        return;
+    }
+    // Dirty pages of a shared mapping stay in the page cache, dropping them only unmaps them from this process
+    msync(mapping, mappingSize, MS_ASYNC);
+    madvise(mapping, mappingSize, MADV_DONTNEED);
+}
@@ -0,0 +1,48 @@
+#ifndef TILEDHEIGHTMAP_HPP
+#define TILEDHEIGHTMAP_HPP
+
+
+#include <cstddef>
+#include <string>
+
+// Square heightmap kept in a memory-mapped file, stored as square tiles laid out one after another
+// so that a tile and its neighbours only touch a few contiguous runs of pages.
+// Maps can be far larger than memory, only the pages in use are resident.
+class TiledHeightmap {
+public:
+    TiledHeightmap() = default;
+    ~TiledHeightmap();
+
+    TiledHeightmap(const TiledHeightmap&) = delete;
+    TiledHeightmap& operator=(const TiledHeightmap&) = delete;
+
+    // Creates or truncates the file for a size x size map, all heights start at 0
+    bool create(const std::string& path, int size, int tileSize);
+    // Opens a file made by create
+    bool open(const std::string& path);
+    void close();
+
+    int size() const { return mapSize; }
+    int tileSize() const { return tileLength; }
+    int tilesPerSide() const { return (mapSize + tileLength - 1) / tileLength; }
+
+    // Copies a rectangle of the map to or from row-major memory with rows stride floats apart
+    void read(int x, int y, int width, int height, float* out, size_t stride) const;
+    void write(int x, int y, int width, int height, const float* in, size_t stride);
+
+    // Starts writing dirty pages back and unmaps everything, keeping the resident set to what is used next
+    void release();
+
+private:
+    int fileHandle = -1;
+    unsigned char* mapping = nullptr;
+    size_t mappingSize = 0;
+    int mapSize = 0;
+    int tileLength = 0;
+
+    float* tile(int tileX, int tileY) const;
+    bool mapFile(bool writeHeader);
+};
+
+
+#endif
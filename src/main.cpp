@@ -1,57 +1,538 @@
+#include "Batch.hpp"
+#include "Checkpoint.hpp"
 #include "Erosion.hpp"
-#include "../simplex/SimplexNoise.hpp"
-#include <tiffio.h>
+#include "ErosionPyramid.hpp"
+#include "MapGenerator.hpp"
+#include "MapInput.hpp"
+#include "PipeErosion.hpp"
+#include "ShardedErosion.hpp"
+#include "SnapshotRing.hpp"
+#include "TiffWriter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
 
-void writeImage(const char* name, int size, uint16_t* buffer, int sizeOfBuffer) {
-    TIFF* tif = TIFFOpen(name, "w");
-    if (tif) {
-        TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, size);
-        TIFFSetField(tif, TIFFTAG_IMAGELENGTH, size);
-        TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 1);
-        TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
-        TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, size);
-        TIFFSetField(tif, TIFFTAG_ORIENTATION, (int)ORIENTATION_TOPLEFT);
-        TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-        TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-        TIFFWriteEncodedStrip(tif, 0, buffer, sizeOfBuffer);
-        TIFFWriteDirectory(tif);
-        TIFFClose(tif);
+int main(int argc, char* argv[]) {
+    const char* usage = "Usage is ./Hydraulic-Erosion <filename> <resolution> <iterations> [--threads <count>] "
+                        "[--schedule sequential|tiled|binned] [--kernel scalar|sse|avx2|avx512|auto] [--stats <file.json>] "
+                        "[--tile-store <file> [--tile-size <size>]] [--compression none|deflate|lzw|zstd] "
+                        "[--format uint16|float32] [--image-tile-size <size>] [--checkpoint <file> [--checkpoint-every <droplets>]] "
+                        "[--resume <file>] [--layout rowmajor|blocked] [--engine droplets|pipe] "
+                        "[--pyramid <levels>|<scale>:<droplets>,...] [--input <file> [--input-format tiff|float32|uint16] "
+                        "[--input-range normalize|raw] [--input-nodata <value>]] "
+                        "[--converge <threshold> [--converge-batch <droplets>]] [--time-budget <seconds>] "
+                        "[--shards <count> [--shard-epochs <count>]] "
+                        "[--snapshot <name> [--snapshot-every <droplets>] [--snapshot-size <size>]]\n"
+                        "   or ./Hydraulic-Erosion --batch <manifest.csv> [--threads <count>] [--kernel <kernel>] "
+                        "[--compression <compression>] [--format <format>] [--image-tile-size <size>]\n"
+                        "   or ./Hydraulic-Erosion --watch <name> [--frame-prefix <prefix>] [--poll <milliseconds>] "
+                        "[--compression <compression>] [--format <format>]";
+    // Batch runs take every map from the manifest instead of the positional arguments
+    bool batch = argc >= 3 && std::string(argv[1]) == "--batch";
+    // Watching dumps the frames another run publishes instead of eroding
+    bool watch = argc >= 3 && std::string(argv[1]) == "--watch";
+    if (argc < 4 && !batch && !watch) {
+        std::cout << usage << std::endl;
+        return EXIT_FAILURE;
     }
-}
 
-std::vector<float> generateMap(int resolution) {
-    std::vector<float> buf(resolution * resolution);
-    const SimplexNoise noise(1.0f, 0.5f, 1.99f, 0.5f);
-    for (int i = 0; i < resolution * resolution; i++) {
-        buf[i] = ((noise.fractal(8, (float)i / resolution / resolution, (i % resolution) / (float)resolution) + 1) / 2);
+    int resolution = batch || watch ? 0 : atoi(argv[2]);
+
+    Erosion eroder = Erosion();
+    eroder.seed = 1231204;
+    std::string statsFile;
+    std::string tileStore;
+    int tileSize = 1024;
+    TiffOptions imageOptions;
+    std::string checkpointFile;
+    long long checkpointEvery = 1 << 24;
+    std::string resumeFile;
+    HeightmapLayout layout = HeightmapLayout::RowMajor;
+    // The pipe engine takes <iterations> as simulation steps instead of droplets
+    bool pipeEngine = false;
+    // Coarse-to-fine levels, either a level count splitting <iterations> or an explicit schedule
+    std::string pyramid;
+    // Existing heightmap eroded instead of generated noise, its size replaces <resolution>
+    std::string inputFile;
+    std::string inputFormatName;
+    MapInputRange inputRange = MapInputRange::Normalize;
+    // Sample values marking cells without data on top of the usual ones
+    std::vector<float> inputNodata;
+    // Stops before <iterations> droplets once the map settles or the time is up
+    bool adaptive = false;
+    ConvergenceLimits convergence;
+    convergence.threshold = 0;
+    // Worker processes eroding bands of the map, none erodes in this process
+    ShardOptions shardOptions;
+    shardOptions.numShards = 0;
+    // Live frames published to a shared-memory ring while eroding
+    std::string snapshotName;
+    long long snapshotEvery = 1 << 20;
+    int snapshotSize = 1024;
+    std::string framePrefix = "frame";
+    int pollMilliseconds = 200;
+    // Without --schedule a thread count picks the tiled schedule, so the map doesn't depend on the count
+    bool threadsGiven = false;
+    bool scheduleGiven = false;
+    for (int i = batch || watch ? 3 : 4; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[i + 1];
+
+        if (option == "--threads") {
+            eroder.numThreads = std::max(1, atoi(value.c_str()));
+            threadsGiven = true;
+        } else if (option == "--schedule") {
+            scheduleGiven = true;
+            if (value == "sequential") {
+                eroder.schedule = DropletSchedule::Sequential;
+            } else if (value == "tiled") {
+                eroder.schedule = DropletSchedule::Tiled;
+            } else if (value == "binned") {
+                eroder.schedule = DropletSchedule::Binned;
+            } else {
+                std::cout << "Unknown schedule " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--kernel") {
+            if (!parseErosionKernel(value, eroder.kernel)) {
+                std::cout << "Unknown kernel " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--stats") {
+            statsFile = value;
+            eroder.collectStats = true;
+        } else if (option == "--tile-store") {
+            tileStore = value;
+        } else if (option == "--tile-size") {
+            tileSize = std::max(1, atoi(value.c_str()));
+        } else if (option == "--compression") {
+            if (!parseTiffCompression(value, imageOptions.compression)) {
+                std::cout << "Unknown compression " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+            if (!tiffCompressionAvailable(imageOptions.compression)) {
+                std::cout << "libtiff was built without " << value << " support" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--format") {
+            if (value == "uint16") {
+                imageOptions.format = TiffSampleFormat::UInt16;
+            } else if (value == "float32") {
+                imageOptions.format = TiffSampleFormat::Float32;
+            } else {
+                std::cout << "Unknown format " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--image-tile-size") {
+            imageOptions.tileSize = std::max(1, atoi(value.c_str()));
+        } else if (option == "--checkpoint") {
+            checkpointFile = value;
+        } else if (option == "--checkpoint-every") {
+            checkpointEvery = std::max(1LL, atoll(value.c_str()));
+        } else if (option == "--resume") {
+            resumeFile = value;
+        } else if (option == "--layout") {
+            if (value == "rowmajor") {
+                layout = HeightmapLayout::RowMajor;
+            } else if (value == "blocked") {
+                layout = HeightmapLayout::Blocked;
+            } else {
+                std::cout << "Unknown layout " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--engine") {
+            if (value == "droplets") {
+                pipeEngine = false;
+            } else if (value == "pipe") {
+                pipeEngine = true;
+            } else {
+                std::cout << "Unknown engine " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--pyramid") {
+            pyramid = value;
+        } else if (option == "--converge") {
+            adaptive = true;
+            convergence.threshold = atof(value.c_str());
+        } else if (option == "--converge-batch") {
+            convergence.batchSize = std::max(0, atoi(value.c_str()));
+        } else if (option == "--time-budget") {
+            adaptive = true;
+            convergence.timeBudgetSeconds = atof(value.c_str());
+        } else if (option == "--shards") {
+            shardOptions.numShards = std::max(1, atoi(value.c_str()));
+        } else if (option == "--shard-epochs") {
+            shardOptions.epochs = std::max(1, atoi(value.c_str()));
+        } else if (option == "--snapshot") {
+            snapshotName = value;
+        } else if (option == "--snapshot-every") {
+            snapshotEvery = std::max(1LL, atoll(value.c_str()));
+        } else if (option == "--snapshot-size") {
+            snapshotSize = std::max(0, atoi(value.c_str()));
+        } else if (option == "--frame-prefix") {
+            framePrefix = value;
+        } else if (option == "--poll") {
+            pollMilliseconds = std::max(1, atoi(value.c_str()));
+        } else if (option == "--input") {
+            inputFile = value;
+        } else if (option == "--input-format") {
+            inputFormatName = value;
+        } else if (option == "--input-range") {
+            if (!parseMapInputRange(value, inputRange)) {
+                std::cout << "Unknown input range " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == "--input-nodata") {
+            inputNodata.push_back((float)atof(value.c_str()));
+        } else {
+            std::cout << usage << std::endl;
+            return EXIT_FAILURE;
+        }
     }
-    return buf;
-}
 
-int main(int argc, char* argv[]) {
-    if (argc < 4) {
-        std::cout << "Usage is ./Hydraulic-Erosion <filename> <resolution> <iterations>" << std::endl;
+    if (!tileStore.empty() && (!checkpointFile.empty() || !resumeFile.empty())) {
+        std::cout << "Checkpoints can't be used with a tile store" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (pipeEngine && (!tileStore.empty() || !checkpointFile.empty() || !resumeFile.empty() || !statsFile.empty() ||
+                       layout != HeightmapLayout::RowMajor)) {
+        std::cout << "The pipe engine can't be used with a tile store, checkpoints, stats or the blocked layout"
+                  << std::endl;
         return EXIT_FAILURE;
     }
+    bool snapshots = !snapshotName.empty();
+    if (watch) {
+        if (batch || pipeEngine || !pyramid.empty() || !tileStore.empty() || !checkpointFile.empty() ||
+            !resumeFile.empty() || !statsFile.empty() || !inputFile.empty() || adaptive || snapshots ||
+            shardOptions.numShards > 0) {
+            std::cout << "Watching only takes the frame prefix, the poll interval and image options" << std::endl;
+            return EXIT_FAILURE;
+        }
+        SnapshotReader reader;
+        // A ring left behind by a run that crashed is replaced by the next run publishing under its name
+        while (!reader.open(argv[2]) || reader.publisherGone()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(pollMilliseconds));
+        }
+        std::cout << "Watching " << argv[2] << std::endl;
+        SnapshotFrame frame;
+        long long lastFrame = -1;
+        while (true) {
+            // Checked before reading so the last frame is read once the run is done
+            bool finished = reader.finished();
+            bool gone = reader.publisherGone();
+            if (reader.read(frame) && frame.frame != lastFrame) {
+                lastFrame = frame.frame;
+                std::string path = framePrefix + "-" + std::to_string(frame.frame) + ".tif";
+                bool frameWritten = writeTiledImage(path.c_str(), frame.size,
+                                                    [&](int x, int y, int width, int height, float* out, size_t stride) {
+                    for (int row = 0; row < height; row++) {
+                        std::copy_n(frame.heights.data() + (size_t)(y + row) * frame.size + x, width,
+                                    out + row * stride);
+                    }
+                }, imageOptions);
+                if (!frameWritten) {
+                    std::cout << "Could not write " << path << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::cout << "Wrote " << path << " at droplet " << frame.droplets << " of " << frame.totalDroplets
+                          << std::endl;
+            }
+            if (finished) {
+                break;
+            }
+            if (gone) {
+                std::cout << "The run publishing " << argv[2] << " stopped without finishing" << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(pollMilliseconds));
+        }
+        return EXIT_SUCCESS;
+    }
+    if (batch) {
+        if (pipeEngine || !pyramid.empty() || !tileStore.empty() || !checkpointFile.empty() || !resumeFile.empty() ||
+            !statsFile.empty() || !inputFile.empty() || adaptive || layout != HeightmapLayout::RowMajor ||
+            eroder.schedule != DropletSchedule::Sequential || shardOptions.numShards > 0 || snapshots) {
+            std::cout << "Batch runs only take threads, the kernel and image options" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::vector<BatchJob> jobs;
+        std::string error;
+        if (!loadBatchManifest(argv[2], jobs, error)) {
+            std::cout << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        BatchOptions batchOptions;
+        batchOptions.numThreads = eroder.numThreads;
+        batchOptions.kernel = eroder.kernel;
+        batchOptions.image = imageOptions;
+        return runBatch(jobs, batchOptions) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    int resolution = atoi(argv[2]);
+    std::vector<PyramidLevel> pyramidLevels;
+    if (!pyramid.empty()) {
+        if (pipeEngine || !tileStore.empty() || !checkpointFile.empty() || !resumeFile.empty() ||
+            layout != HeightmapLayout::RowMajor) {
+            std::cout << "The pyramid can't be used with the pipe engine, a tile store, checkpoints or the blocked layout"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (pyramid.find(':') == std::string::npos) {
+            pyramidLevels = pyramidSchedule(atoi(argv[3]), std::max(1, atoi(pyramid.c_str())));
+        } else if (!parsePyramidSchedule(pyramid, pyramidLevels)) {
+            std::cout << "Invalid pyramid schedule " << pyramid << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (adaptive && (pipeEngine || !pyramid.empty() || !tileStore.empty() || !checkpointFile.empty() ||
+                     !resumeFile.empty())) {
+        std::cout << "Convergence and time limits only work on single in-memory droplet runs" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (shardOptions.numShards > 0 && (pipeEngine || !pyramid.empty() || !tileStore.empty() ||
+                                       !checkpointFile.empty() || !resumeFile.empty() || adaptive ||
+                                       layout != HeightmapLayout::RowMajor || eroder.kernel != ErosionKernel::Scalar ||
+                                       eroder.schedule != DropletSchedule::Sequential)) {
+        std::cout << "Shards erode a single in-memory row-major map with the scalar kernel and sequential schedule"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (snapshots && (pipeEngine || !pyramid.empty() || !tileStore.empty() || adaptive ||
+                      shardOptions.numShards > 0)) {
+        std::cout << "Snapshots are only published by in-memory droplet runs without convergence or time limits"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (threadsGiven && !scheduleGiven && shardOptions.numShards == 0) {
+        eroder.schedule = DropletSchedule::Tiled;
+    }
+    if (scheduleGiven && eroder.schedule != DropletSchedule::Tiled && eroder.numThreads > 1 && !pipeEngine &&
+        shardOptions.numShards == 0) {
+        std::cout << "The sequential and binned schedules run on one thread, more threads need the tiled schedule"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    MapInput input;
+    if (!inputFile.empty()) {
+        MapInputFormat inputFormat = mapInputFormatOf(inputFile);
+        if (!inputFormatName.empty() && !parseMapInputFormat(inputFormatName, inputFormat)) {
+            std::cout << "Unknown input format " << inputFormatName << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!resumeFile.empty()) {
+            std::cout << "An input map can't be used when resuming, the checkpoint holds the map" << std::endl;
+            return EXIT_FAILURE;
+        }
+        input.range = inputRange;
+        input.nodata.insert(input.nodata.end(), inputNodata.begin(), inputNodata.end());
+        std::string error;
+        if (!input.open(inputFile, inputFormat, error)) {
+            std::cout << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (resolution != 0 && resolution != input.size()) {
+            std::cout << inputFile << " is " << input.size() << " cells across, not " << resolution << std::endl;
+            return EXIT_FAILURE;
+        }
+        resolution = input.size();
+    }
+    // Starts a new map from the input if there is one, from generated noise otherwise
+    auto fillMap = [&](auto* map) {
+        if (inputFile.empty()) {
+            generateMap(map, eroder.numThreads);
+            std::cout << "Finished generating map" << std::endl;
+            return true;
+        }
+        if (!input.read(map)) {
+            std::cout << "Could not read " << inputFile << std::endl;
+            return false;
+        }
+        input.close();
+        std::cout << "Finished reading map" << std::endl;
+        return true;
+    };
+    imageOptions.numThreads = eroder.numThreads;
 
-    auto map = generateMap(resolution);
-    std::cout << "Finished generating map" << std::endl;
+    bool written;
+    auto outputStart = std::chrono::steady_clock::now();
+    if (pipeEngine) {
+        Heightmap map(resolution, HeightmapLayout::RowMajor);
+        if (!fillMap(&map)) {
+            return EXIT_FAILURE;
+        }
 
-    Erosion eroder = Erosion();
-    eroder.seed = 1231204;
-    eroder.erode(&map, resolution, atoi(argv[3]), true);
+        PipeErosion pipes;
+        pipes.numThreads = eroder.numThreads;
+        pipes.erode(map.view(), atoi(argv[3]), true);
+        pipes.settle(map.view());
+
+        written = writeTiledImage(argv[1], resolution, [&](int x, int y, int width, int height, float* out, size_t stride) {
+            map.read(x, y, width, height, out, stride);
+        }, imageOptions);
+    } else if (!pyramidLevels.empty()) {
+        Heightmap map(resolution, HeightmapLayout::RowMajor);
+        if (!fillMap(&map)) {
+            return EXIT_FAILURE;
+        }
+        if (!erodePyramid(eroder, map.view(), pyramidLevels, true)) {
+            std::cout << "Every pyramid level needs a smaller scale than the one before and at least 2 x 2 cells"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        outputStart = std::chrono::steady_clock::now();
+        written = writeTiledImage(argv[1], resolution, [&](int x, int y, int width, int height, float* out, size_t stride) {
+            map.read(x, y, width, height, out, stride);
+        }, imageOptions);
+    } else if (shardOptions.numShards > 0) {
+        Heightmap map(resolution, HeightmapLayout::RowMajor);
+        if (!fillMap(&map)) {
+            return EXIT_FAILURE;
+        }
+        std::string error;
+        if (!erodeSharded(eroder, map.view(), atoi(argv[3]), true, shardOptions, error)) {
+            std::cout << error << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        outputStart = std::chrono::steady_clock::now();
+        written = writeTiledImage(argv[1], resolution, [&](int x, int y, int width, int height, float* out, size_t stride) {
+            map.read(x, y, width, height, out, stride);
+        }, imageOptions);
+    } else if (!tileStore.empty()) {
+        // Out of core: the map only ever lives in the memory-mapped store
+        TiledHeightmap map;
+        if (!map.create(tileStore, resolution, tileSize)) {
+            std::cout << "Could not create tile store " << tileStore << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!fillMap(&map)) {
+            return EXIT_FAILURE;
+        }
+        eroder.erode(&map, atoi(argv[3]), true);
+
+        outputStart = std::chrono::steady_clock::now();
+        written = writeTiledImage(argv[1], resolution, [&](int x, int y, int width, int height, float* out, size_t stride) {
+            map.read(x, y, width, height, out, stride);
+        }, imageOptions);
+    } else {
+        std::unique_ptr<Heightmap> map;
+        long long totalDroplets = atoll(argv[3]);
+        if (!resumeFile.empty()) {
+            // The checkpoint decides the map, the parameters and how many droplets are left
+            ErosionCheckpoint checkpoint;
+            if (!loadCheckpoint(resumeFile, checkpoint)) {
+                std::cout << "Could not read checkpoint " << resumeFile << std::endl;
+                return EXIT_FAILURE;
+            }
+            if (!checkpoint.restore(eroder)) {
+                std::cout << "Checkpoint " << resumeFile << " was taken with the " << erosionKernelName(checkpoint.kernel)
+                          << " kernel, which this CPU can't run" << std::endl;
+                return EXIT_FAILURE;
+            }
+            resolution = checkpoint.mapSize;
+            totalDroplets = checkpoint.totalDroplets;
+            map = std::make_unique<Heightmap>(resolution, layout);
+            map->fromRowMajor(checkpoint.map);
+            std::cout << "Resuming at droplet " << eroder.dropletCursor << " of " << totalDroplets << std::endl;
+        } else {
+            map = std::make_unique<Heightmap>(resolution, layout);
+            if (!fillMap(map.get())) {
+                return EXIT_FAILURE;
+            }
+            eroder.resumeAt(0);
+        }
 
-    // libtiff needs it to be in uint16_t since we're saving in 16 bits
-    std::vector<uint16_t> toSave(map.size());
-    for (int s = 0; s < map.size(); s++) {
-        toSave[s] = map.at(s) * __UINT16_MAX__;
+        if (layout == HeightmapLayout::Blocked && eroder.kernel != ErosionKernel::Scalar) {
+            std::cout << "The blocked layout only runs the scalar kernel" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Runs are only split where the kernel and schedule can be split without changing the result, checkpoints
+        // and snapshots each keep their own cadence rounded up to that
+        long long alignment = eroder.splitAlignment();
+        auto aligned = [&](long long every) { return (every + alignment - 1) / alignment * alignment; };
+        std::unique_ptr<CheckpointWriter> checkpoints;
+        long long checkpointInterval = aligned(1 << 30);
+        if (!checkpointFile.empty()) {
+            checkpoints = std::make_unique<CheckpointWriter>(checkpointFile);
+            checkpointInterval = aligned(checkpointEvery);
+        }
+        SnapshotPublisher publisher;
+        long long snapshotInterval = aligned(1 << 30);
+        if (snapshots) {
+            if (!publisher.create(snapshotName, resolution, snapshotSize)) {
+                std::cout << "Could not create snapshot ring " << snapshotName << std::endl;
+                return EXIT_FAILURE;
+            }
+            snapshotInterval = aligned(snapshotEvery);
+        }
+
+        if (adaptive) {
+            convergence.maxIterations = totalDroplets;
+            ConvergenceReport report = eroder.erodeUntilConverged(map.get(), convergence);
+            std::cout << "Simulated " << report.droplets << " droplets, "
+                      << (report.converged ? "converged" : report.outOfTime ? "out of time" : "reached <iterations>")
+                      << std::endl;
+        } else {
+            ErosionStats totalStats = {};
+            if (snapshots) {
+                publisher.publish(*map, eroder.dropletCursor, totalDroplets);
+            }
+            while (eroder.dropletCursor < totalDroplets) {
+                long long cursor = eroder.dropletCursor;
+                long long nextCheckpoint = (cursor / checkpointInterval + 1) * checkpointInterval;
+                long long nextSnapshot = (cursor / snapshotInterval + 1) * snapshotInterval;
+                long long next = std::min({totalDroplets, nextCheckpoint, nextSnapshot});
+                eroder.erode(map.get(), (int)(next - cursor));
+                totalStats.merge(eroder.stats);
+                if (snapshots && (next == nextSnapshot || next == totalDroplets)) {
+                    publisher.publish(*map, eroder.dropletCursor, totalDroplets);
+                }
+
+                if (checkpoints && next == nextCheckpoint && next < totalDroplets) {
+                    ErosionCheckpoint checkpoint;
+                    checkpoint.capture(eroder);
+                    checkpoint.totalDroplets = totalDroplets;
+                    checkpoint.mapSize = resolution;
+                    checkpoint.map = map->toRowMajor();
+                    checkpoints->submit(std::move(checkpoint));
+                }
+            }
+            eroder.stats = totalStats;
+        }
+        publisher.finish();
+        if (checkpoints && !checkpoints->finish()) {
+            std::cout << "Could not write checkpoint " << checkpointFile << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        outputStart = std::chrono::steady_clock::now();
+        written = writeTiledImage(argv[1], resolution, [&](int x, int y, int width, int height, float* out, size_t stride) {
+            map->read(x, y, width, height, out, stride);
+        }, imageOptions);
+    }
+    if (!written) {
+        std::cout << "Could not write " << argv[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!statsFile.empty()) {
+        eroder.stats.outputSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - outputStart).count();
+        std::ofstream out(statsFile);
+        eroder.stats.writeJson(out);
+        if (!out) {
+            std::cout << "Could not write " << statsFile << std::endl;
+            return EXIT_FAILURE;
+        }
     }
-    
-    writeImage(argv[1], resolution, &toSave[0], 2 * resolution * resolution);
     
     return EXIT_SUCCESS;
 }